@@ -27,10 +27,12 @@ let package = Package(
                 "Makefile",
                 "man",
                 "README.md",
+                "src/batch.c",
                 "src/bench.c",
                 "src/genkat.c",
                 "src/opt.c",
                 "src/run.c",
+                "src/serve.c",
                 "src/test.c",
             ],
             sources: [
@@ -38,6 +40,8 @@ let package = Package(
                 "src/argon2.c",
                 "src/core.c",
                 "src/encoding.c",
+                "src/arena.c",
+                "src/metrics.c",
                 "src/ref.c",
                 "src/thread.c"
             ]
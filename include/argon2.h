@@ -91,6 +91,16 @@ extern "C" {
 #define ARGON2_DEFAULT_FLAGS UINT32_C(0)
 #define ARGON2_FLAG_CLEAR_PASSWORD (UINT32_C(1) << 0)
 #define ARGON2_FLAG_CLEAR_SECRET (UINT32_C(1) << 1)
+/* Encode and decode the tag with the variable-time Base64 codec in
+ * argon2_encode_ctx() and argon2_decode_ctx(). Salts always use it; tags
+ * default to the constant-time one. */
+#define ARGON2_FLAG_FAST_ENCODING (UINT32_C(1) << 2)
+/* Honour the cancel and deadline_ns fields of the context, which are not
+ * read otherwise (so older callers need not initialize them) */
+#define ARGON2_FLAG_CANCEL (UINT32_C(1) << 3)
+/* Background work (re-hashing and the like): under
+ * argon2_executor_configure() it yields to interactive hashes */
+#define ARGON2_FLAG_BULK (UINT32_C(1) << 4)
 
 /* Global flag to determine if we are wiping internal memory buffers. This flag
  * is defined in core.c and defaults to 1 (wipe internal memory). */
@@ -154,13 +164,29 @@ typedef enum Argon2_ErrorCodes {
 
     ARGON2_DECODING_LENGTH_FAIL = -34,
 
-    ARGON2_VERIFY_MISMATCH = -35
+    ARGON2_VERIFY_MISMATCH = -35,
+
+    ARGON2_OUTPUT_CALLBACK_FAIL = -36,
+
+    ARGON2_MEMORY_BUFFER_TOO_SMALL = -37,
+
+    ARGON2_CANCELLED = -38,
+    ARGON2_DEADLINE_EXCEEDED = -39
 } argon2_error_codes;
 
 /* Memory allocator types --- for external allocation */
 typedef int (*allocate_fptr)(uint8_t **memory, size_t bytes_to_allocate);
 typedef void (*deallocate_fptr)(uint8_t *memory, size_t bytes_to_allocate);
 
+/*
+ * Output callback for streamed tags --- receives the tag in order, in chunks
+ * of at most 64 bytes, together with the caller's @arg. The chunk buffer is
+ * only valid during the call and is wiped once the tag is complete. A non-zero
+ * return value aborts the hash.
+ */
+typedef int (*argon2_output_fptr)(const uint8_t *chunk, size_t chunklen,
+                                  void *arg);
+
 /* Argon2 external data structures */
 
 /*
@@ -215,6 +241,11 @@ typedef struct Argon2_Context {
     deallocate_fptr free_cbk;   /* pointer to memory deallocator */
 
     uint32_t flags; /* array of bool options */
+
+    /* Checked between segments when ARGON2_FLAG_CANCEL is set; the hash
+     * stops, wipes its memory and fails once either one trips */
+    const volatile int *cancel; /* non-zero to cancel, may be NULL */
+    uint64_t deadline_ns; /* argon2_monotonic_ns() limit, 0 for none */
 } argon2_context;
 
 /* Argon2 primitive type */
@@ -246,6 +277,317 @@ ARGON2_PUBLIC const char *argon2_type2string(argon2_type type, int uppercase);
  */
 ARGON2_PUBLIC int argon2_ctx(argon2_context *context, argon2_type type);
 
+/*
+ * Same as argon2_ctx, but instead of writing the whole tag to @context->out
+ * (which may then be NULL) it is produced incrementally and handed to
+ * @output_cbk chunk by chunk, so tags up to ARGON2_MAX_OUTLEN bytes can be
+ * derived with constant memory. @context->outlen sets the tag length.
+ * @param  context  Pointer to the Argon2 internal structure
+ * @param  output_cbk Callback receiving the tag chunks
+ * @param  arg Opaque pointer passed to @output_cbk
+ * @return Error code if smth is wrong, ARGON2_OK otherwise;
+ * ARGON2_OUTPUT_CALLBACK_FAIL if @output_cbk aborted
+ */
+ARGON2_PUBLIC int argon2_ctx_stream(argon2_context *context, argon2_type type,
+                                    argon2_output_fptr output_cbk, void *arg);
+
+/*
+ * Limits the segments run at once by all hashes of the process, across all
+ * threads, to @slots (typically the number of cores), and serves them by
+ * priority. For its whole duration, every hash without ARGON2_FLAG_BULK
+ * reserves as many slots as it has threads, whether or not its segments are
+ * running or waiting at the moment. Segments of ARGON2_FLAG_BULK contexts
+ * only run in the slots no interactive hash has reserved (at least none while
+ * the reservations add up to @slots or more), so a new interactive hash takes
+ * its slots back from bulk ones at their next segment boundary. Size @slots
+ * for the interactive threads expected at once plus the share bulk work
+ * should keep. 0 (the default) lifts the limit. No effect in builds without
+ * threads.
+ * @return ARGON2_OK
+ */
+ARGON2_PUBLIC int argon2_executor_configure(uint32_t slots);
+
+/*
+ * Caps the threads of every hash at the CPUs the process may use: those in
+ * its affinity mask and, on Linux, its cgroup v2 cpu.max quota, rounded up.
+ * Lanes, and so the output, stay as they are; with fewer threads than lanes
+ * the lanes of a slice are filled in turns. The CPUs are counted by this
+ * call, so call it again after the affinity or quota changes. No effect in
+ * builds without threads or where the CPUs cannot be counted.
+ * @param enable 1 to cap, 0 to run context->threads threads again
+ * @return The cap in effect, 0 if none
+ */
+ARGON2_PUBLIC uint32_t argon2_thread_cap_enable(int enable);
+
+/*
+ * Current time of the monotonic clock used for argon2_context.deadline_ns
+ */
+ARGON2_PUBLIC uint64_t argon2_monotonic_ns(void);
+
+/* Hash in progress, see argon2_begin() */
+typedef struct Argon2_state argon2_state;
+
+/*
+ * Starts an argon2_ctx() that is then run piecewise with argon2_step(), e.g.
+ * from a single-threaded event loop between I/O callbacks. Hashing the
+ * inputs, allocating the memory and filling the first blocks happen here;
+ * everything runs on the caller's thread regardless of @context->threads.
+ * The state may be stepped and finished from other threads, one at a time;
+ * its memory never comes from the argon2_thread_cache_enable() cache.
+ * @context must stay valid until argon2_finish() or argon2_abort(), which
+ * writes the tag to @context->out and frees the memory.
+ * @param  context  Pointer to the Argon2 internal structure
+ * @param  state  Receives the hash in progress; NULL on error
+ * @return Error code if smth is wrong, ARGON2_OK otherwise
+ */
+ARGON2_PUBLIC int argon2_begin(argon2_context *context, argon2_type type,
+                               argon2_state **state);
+
+/*
+ * Fills at most @max_segments segments of the hash in progress. A segment is
+ * m_cost / (4 * lanes) blocks of 1 KiB and takes roughly a microsecond per
+ * block, so more lanes give finer steps for the same memory.
+ * @return 1 if segments remain, ARGON2_OK once the memory is filled, or an
+ * error code (ARGON2_CANCELLED, ARGON2_DEADLINE_EXCEEDED), after which only
+ * argon2_abort() may be called
+ */
+ARGON2_PUBLIC int argon2_step(argon2_state *state, uint32_t max_segments);
+
+/*
+ * Fills the remaining segments, writes the tag to @context->out of
+ * argon2_begin(), and frees @state and its memory, also when filling fails
+ * @return Error code if smth is wrong, ARGON2_OK otherwise
+ */
+ARGON2_PUBLIC int argon2_finish(argon2_state *state);
+
+/*
+ * Drops a hash in progress: wipes and frees its memory and @state
+ */
+ARGON2_PUBLIC void argon2_abort(argon2_state *state);
+
+/*
+ * Returns the size in bytes of the memory argon2_ctx_with_memory() needs for
+ * the given cost and number of lanes, including room to align the blocks
+ * inside the buffer; 0 if @lanes is 0 or the size does not fit a size_t.
+ * @param m_cost Memory cost in kibibytes, as in argon2_context
+ * @param lanes Number of lanes, as in argon2_context
+ */
+ARGON2_PUBLIC size_t argon2_memory_required(uint32_t m_cost, uint32_t lanes);
+
+/*
+ * Same as argon2_ctx, but the memory blocks live in @memory instead of being
+ * allocated: @context->allocate_cbk and @context->free_cbk are not called.
+ * The buffer is wiped before returning but stays owned by the caller, so it
+ * can be pre-faulted once and reused for every call.
+ * @param  context  Pointer to the Argon2 internal structure
+ * @param  memory  Scratch buffer of at least @memory_len bytes
+ * @param  memory_len Must be at least argon2_memory_required(context->m_cost,
+ * context->lanes)
+ * @return Error code if smth is wrong, ARGON2_OK otherwise;
+ * ARGON2_MEMORY_BUFFER_TOO_SMALL if @memory is NULL or too small
+ */
+ARGON2_PUBLIC int argon2_ctx_with_memory(argon2_context *context,
+                                         argon2_type type, void *memory,
+                                         size_t memory_len);
+
+/*
+ * A session keeps one scratch buffer for consecutive hashes on the same
+ * thread, so they neither allocate nor fault in fresh pages. Sessions are not
+ * thread-safe: use one per thread.
+ */
+typedef struct Argon2_session argon2_session;
+
+/*
+ * Session policy: do not wipe the memory blocks after every hash, only in
+ * argon2_session_scrub(), argon2_session_scrub_idle() and
+ * argon2_session_release(). Every block is overwritten in the first pass of
+ * the next hash, so this saves one full write pass over memory per call.
+ *
+ * Security trade-off: until the next wipe, the blocks of the last hash stay
+ * in process memory. Anyone who can read that memory (a core dump, swap, a
+ * memory disclosure bug) can use them to test password guesses far more
+ * cheaply than by recomputing Argon2. Only use this in a trusted process
+ * that does not dump core or swap, and bound the exposure with
+ * argon2_session_scrub_idle().
+ */
+#define ARGON2_SESSION_DEFER_WIPE (UINT32_C(1) << 0)
+
+/*
+ * Creates a session
+ * @param flags 0 or ARGON2_SESSION_DEFER_WIPE
+ * @return The new session, or NULL if out of memory
+ */
+ARGON2_PUBLIC argon2_session *argon2_session_create(uint32_t flags);
+
+/*
+ * Same as argon2_ctx, with the memory blocks in the session's buffer, which
+ * grows as needed. @context->allocate_cbk and @context->free_cbk are not used.
+ */
+ARGON2_PUBLIC int argon2_session_ctx(argon2_session *session,
+                                     argon2_context *context,
+                                     argon2_type type);
+
+/*
+ * Same as argon2_verify, with the memory blocks in the session's buffer
+ */
+ARGON2_PUBLIC int argon2_session_verify(argon2_session *session,
+                                        const char *encoded, const void *pwd,
+                                        const size_t pwdlen, argon2_type type);
+
+/*
+ * Wipes the session's buffer now if it holds blocks of an earlier hash
+ */
+ARGON2_PUBLIC void argon2_session_scrub(argon2_session *session);
+
+/*
+ * If the session has not been used for at least @idle_ns nanoseconds, wipes
+ * its buffer if needed and returns the buffer's pages to the kernel, keeping
+ * the address range for the next hash; meant to be called periodically by
+ * the owner of the session. argon2_arena_trim() does the same for every
+ * session at once.
+ * @return 1 if pages were returned, 0 otherwise
+ */
+ARGON2_PUBLIC int argon2_session_scrub_idle(argon2_session *session,
+                                            uint64_t idle_ns);
+
+/*
+ * Wipes and frees the session's buffer and the session itself
+ */
+ARGON2_PUBLIC void argon2_session_release(argon2_session *session);
+
+/* Memory held by the library between hashes (session and thread arenas) */
+typedef struct Argon2_memory_stats {
+    size_t arenas;         /* number of pooled buffers */
+    size_t reserved_bytes; /* address space mapped for them */
+    size_t resident_bytes; /* bytes touched since they were last trimmed */
+} argon2_memory_stats;
+
+/*
+ * Fills @stats with a snapshot of the pooled memory
+ */
+ARGON2_PUBLIC void argon2_get_memory_stats(argon2_memory_stats *stats);
+
+/*
+ * Returns the pages of every pooled buffer that has been idle for at least
+ * @idle_ns nanoseconds to the kernel, wiping them first where the kernel
+ * does not. Buffers in use are skipped. Safe to call from any thread, e.g.
+ * a periodic housekeeping timer, so that resident memory follows load
+ * instead of the high-water mark.
+ * @return Number of resident bytes released
+ */
+ARGON2_PUBLIC size_t argon2_arena_trim(uint64_t idle_ns);
+
+/*
+ * Makes every thread keep the memory blocks of its last argon2_ctx() (and so
+ * argon2_hash(), argon2_verify(), ...) call in a per-thread arena, wiped but
+ * still mapped, and reuse it when the next request fits. Contexts with an
+ * allocate_cbk are not affected. Arenas are released when their thread exits,
+ * or when the hash still using one finishes if that comes later, and show up
+ * in argon2_get_memory_stats() and argon2_arena_trim().
+ * @param max_cached_bytes Cap on the bytes reserved by all thread arenas
+ * together; requests that would exceed it fall back to plain allocation.
+ * 0 disables the cache for new requests.
+ * @return ARGON2_OK, or ARGON2_THREAD_FAIL if thread-local storage could not
+ * be set up
+ */
+ARGON2_PUBLIC int argon2_thread_cache_enable(size_t max_cached_bytes);
+
+/*
+ * Reference locality statistics, for tuning prefetch distance, page size and
+ * NUMA placement on real parameter sets. Only builds with
+ * ARGON2_TRACE_LOCALITY defined (make TRACE_LOCALITY=1) collect them; the
+ * accounting costs every filled block a few extra instructions.
+ */
+#define ARGON2_LOCALITY_PASSES 3 /* pass 0, pass 1, and all later passes */
+#define ARGON2_LOCALITY_BUCKETS 32
+
+typedef struct Argon2_locality_stats {
+    uint64_t segments;   /* segments filled */
+    uint64_t refs;       /* reference blocks picked */
+    uint64_t cross_lane; /* of which in another lane than the new block */
+    /* References by distance d, in blocks, between the new block and its
+     * reference block: bucket k counts 2^k <= d < 2^(k+1) */
+    uint64_t distance[ARGON2_LOCALITY_BUCKETS];
+    uint64_t pages_4k; /* distinct 4 KiB pages referenced, summed over segments */
+    uint64_t pages_2m; /* distinct 2 MiB pages referenced, summed over segments */
+} argon2_locality_stats;
+
+/*
+ * Fills @stats with the totals of all hashes since the last reset, for one
+ * type, pass (passes beyond ARGON2_LOCALITY_PASSES share the last entry) and
+ * slice
+ * @return 1 if @stats was filled in, 0 if the build does not collect these
+ * statistics or @type or @slice is out of range (@stats is zeroed)
+ */
+ARGON2_PUBLIC int argon2_get_locality_stats(argon2_type type, uint32_t pass,
+                                            uint32_t slice,
+                                            argon2_locality_stats *stats);
+
+/*
+ * Clears the statistics read by argon2_get_locality_stats()
+ */
+ARGON2_PUBLIC void argon2_reset_locality_stats(void);
+
+/*
+ * Process-wide metrics, for export to a monitoring system. Each thread
+ * counts into its own shard, so hashing threads never wait on each other;
+ * argon2_metrics_snapshot() adds the shards up.
+ */
+#define ARGON2_METRICS_ERRORS (1 - ARGON2_DEADLINE_EXCEEDED)
+#define ARGON2_METRICS_TUPLES 16
+/* Latency buckets: four per power of two from 64 Ki ns (65 us) to 64 Gi ns
+   (68 s), see argon2_metrics_bucket_ns() */
+#define ARGON2_METRICS_BUCKETS 80
+
+/* Latency of the hashes with one set of parameters */
+typedef struct Argon2_metrics_histogram {
+    argon2_type type;
+    uint32_t m_cost;
+    uint32_t t_cost;
+    uint32_t lanes;
+    uint64_t count;  /* hashes, including those slower than the last bucket */
+    uint64_t sum_ns; /* their total duration */
+    uint64_t buckets[ARGON2_METRICS_BUCKETS]; /* per bucket, not cumulative */
+} argon2_metrics_histogram;
+
+typedef struct Argon2_metrics {
+    /* Successful argon2_ctx() style hashes (including those run by the
+       verify functions) and verifies, by argon2_type */
+    uint64_t hashes[3];
+    uint64_t verifies[3];
+    /* Failed hashes and mismatching verifies, by -error code */
+    uint64_t failures[ARGON2_METRICS_ERRORS];
+    uint64_t allocated_bytes; /* held by hashes from allocate_memory() now */
+    uint32_t active_workers;  /* segments being filled now */
+    uint32_t queued_segments; /* segments waiting for an executor slot */
+    uint32_t thread_cap;      /* from argon2_thread_cap_enable(), 0 if none */
+    uint32_t last_threads;    /* threads of the most recently started hash */
+    /* Latency of successful hashes, by parameter set in order of first use;
+       parameter sets beyond the first ARGON2_METRICS_TUPLES go to @other */
+    uint32_t histograms;
+    argon2_metrics_histogram histogram[ARGON2_METRICS_TUPLES];
+    argon2_metrics_histogram other;
+} argon2_metrics;
+
+/*
+ * Fills @metrics with the totals since the process started
+ */
+ARGON2_PUBLIC void argon2_metrics_snapshot(argon2_metrics *metrics);
+
+/*
+ * Upper bound, in nanoseconds, of latency bucket @bucket
+ */
+ARGON2_PUBLIC uint64_t argon2_metrics_bucket_ns(uint32_t bucket);
+
+/*
+ * Writes @metrics as OpenMetrics text exposition, with its "# EOF" line.
+ * Like snprintf(), writes at most @outlen - 1 characters and a NUL.
+ * @return The length of the whole text, which did not fit if it is not below
+ * @outlen
+ */
+ARGON2_PUBLIC size_t argon2_metrics_openmetrics(const argon2_metrics *metrics,
+                                                char *out, size_t outlen);
+
 /**
  * Hashes a password with Argon2i, producing an encoded hash
  * @param t_cost Number of iterations
@@ -347,6 +689,50 @@ ARGON2_PUBLIC int argon2id_verify(const char *encoded, const void *pwd,
 ARGON2_PUBLIC int argon2_verify(const char *encoded, const void *pwd,
                                 const size_t pwdlen, argon2_type type);
 
+/* Capacity of the inline salt and tag buffers of argon2_parsed_hash */
+#define ARGON2_PARSED_SALT_MAX 64
+#define ARGON2_PARSED_HASH_MAX 64
+
+/*
+ * An encoded hash decoded once by argon2_parse_encoded(). It owns its salt
+ * and tag, so callers can store it next to the encoded string and verify
+ * against it repeatedly without re-parsing or heap allocation.
+ */
+typedef struct Argon2_parsed_hash {
+    argon2_type type;
+    uint32_t version;
+    uint32_t m_cost;
+    uint32_t t_cost;
+    uint32_t lanes;
+    uint32_t saltlen;
+    uint32_t hashlen;
+    uint8_t salt[ARGON2_PARSED_SALT_MAX];
+    uint8_t hash[ARGON2_PARSED_HASH_MAX];
+} argon2_parsed_hash;
+
+/**
+ * Parses an encoded string into an argon2_parsed_hash
+ * @param parsed Structure to fill in
+ * @param encoded String encoding parameters, salt, hash
+ * @param type The argon2_type the string is expected to use
+ * @return ARGON2_OK on success, ARGON2_DECODING_FAIL if the string is
+ * malformed or its salt or tag does not fit the inline buffers, or another
+ * error code if the encoded parameters are invalid
+ */
+ARGON2_PUBLIC int argon2_parse_encoded(argon2_parsed_hash *parsed,
+                                       const char *encoded, argon2_type type);
+
+/**
+ * Verifies a password against a hash parsed by argon2_parse_encoded()
+ * @param parsed Parsed hash
+ * @param pwd Pointer to password
+ * @param pwdlen Password size in bytes
+ * @return ARGON2_OK if the password matches, ARGON2_VERIFY_MISMATCH if not,
+ * another error code otherwise. Does not allocate besides the memory matrix.
+ */
+ARGON2_PUBLIC int argon2_verify_parsed(const argon2_parsed_hash *parsed,
+                                       const void *pwd, const size_t pwdlen);
+
 /**
  * Argon2d: Version of Argon2 that picks memory blocks depending
  * on the password and salt. Only for side-channel-free
@@ -416,6 +802,28 @@ ARGON2_PUBLIC int argon2_verify_ctx(argon2_context *context, const char *hash,
  */
 ARGON2_PUBLIC const char *argon2_error_message(int error_code);
 
+/*
+ * Encodes the parameters, salt and tag (context->out) of a hash computed
+ * with argon2_ctx() as a "$argon2id$v=19$m=..." string. With
+ * ARGON2_FLAG_FAST_ENCODING in context->flags the tag uses the faster,
+ * variable-time Base64 codec, e.g. for bulk re-encoding.
+ * @param dst Receives the string, at most @dst_len bytes including the NUL
+ * @return Error code if smth is wrong, ARGON2_OK otherwise
+ */
+ARGON2_PUBLIC int argon2_encode_ctx(char *dst, size_t dst_len,
+                                    argon2_context *context, argon2_type type);
+
+/*
+ * Decodes an encoded hash into @context. context->salt and context->out must
+ * point to buffers of context->saltlen and context->outlen bytes, which are
+ * set to the decoded lengths. ARGON2_FLAG_FAST_ENCODING in context->flags
+ * decodes the tag with the variable-time codec; flags are reset to
+ * ARGON2_DEFAULT_FLAGS on return.
+ * @return Error code if smth is wrong, ARGON2_OK otherwise
+ */
+ARGON2_PUBLIC int argon2_decode_ctx(argon2_context *context,
+                                    const char *encoded, argon2_type type);
+
 /**
  * Returns the encoded hash length for the given input parameters
  * @param t_cost  Number of iterations
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Checks argon2 -batch against one argon2 call per record
+
+make argon2 > /dev/null
+if [ $? -ne 0 ]
+then
+  exit 1
+fi
+
+if ! ./argon2 -batch < /dev/null 2> /dev/null
+then
+  printf "argon2 -batch: not supported in this build, skipped\n"
+  exit 0
+fi
+
+# single password salt [costs]: what -batch must print for the record
+single() {
+  printf '%s' "$1" | ./argon2 "$2" -id ${3:--t 2 -k 256} -e
+}
+
+check() {
+  printf "$1: "
+  if diff kats/run_batch_expected kats/run_batch_out
+  then
+    printf "OK\n"
+  else
+    printf "ERROR\n"
+    rm -f kats/run_batch_*
+    exit 1
+  fi
+}
+
+# Newline-terminated records, one malformed and one with a CRLF line end
+printf 'password\tsomesalt\npw2\tsomesalt2\tm=64,t=1,p=2\nno salt\n' \
+  > kats/run_batch_in
+printf 'crlf\tsomesaltcrlf\r\nlast\tsomesaltlast\n' >> kats/run_batch_in
+{
+  single password somesalt
+  single pw2 somesalt2 "-k 64 -t 1 -p 2"
+  printf 'error: Decoding failed\n'
+  single crlf somesaltcrlf
+  single last somesaltlast
+} > kats/run_batch_expected
+./argon2 -batch -w 3 -id -t 2 -k 256 < kats/run_batch_in \
+  > kats/run_batch_out 2> /dev/null
+check "argon2 -batch -w 3"
+
+# NUL-terminated records keep newlines and carriage returns
+printf 'two\nlines\tsomesalt\0password\tsomesaltcr\r\0' > kats/run_batch_in
+{
+  single "$(printf 'two\nlines')" somesalt
+  single password "$(printf 'somesaltcr\r')"
+} > kats/run_batch_expected
+./argon2 -batch -0 -w 3 -id -t 2 -k 256 < kats/run_batch_in \
+  > kats/run_batch_out
+check "argon2 -batch -0 -w 3"
+
+rm -f kats/run_batch_*
+
+exit 0
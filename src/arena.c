@@ -0,0 +1,431 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+/* for MAP_ANONYMOUS and madvise() on glibc */
+#define _DEFAULT_SOURCE
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ARENA_MMAP 1
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include <stdlib.h>
+
+#include "argon2.h"
+#include "arena.h"
+#include "core.h"
+#include "thread.h"
+
+/* Every live arena, guarded by registry_lock */
+static argon2_arena *registry = NULL;
+static argon2_mutex_t registry_lock = ARGON2_MUTEX_INIT;
+
+/***************Page mapping*****************/
+
+static uint8_t *pages_map(size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(ARENA_MMAP)
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : (uint8_t *)p;
+#else
+    return malloc(size);
+#endif
+}
+
+static void pages_unmap(uint8_t *base, size_t size) {
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(base, 0, MEM_RELEASE);
+#elif defined(ARENA_MMAP)
+    munmap(base, size);
+#else
+    (void)size;
+    free(base);
+#endif
+}
+
+/*
+ * Hands the physical pages behind @base back to the kernel while keeping the
+ * mapping. On Linux, MADV_DONTNEED drops private anonymous pages at once and
+ * they read back as zeros, which also wipes them; elsewhere the contents
+ * after the call are unspecified, so the caller wipes first.
+ * @return 1 if the pages were released, 0 if they stay resident
+ */
+static int pages_release(uint8_t *base, size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(base, size, MEM_RESET, PAGE_READWRITE) != NULL;
+#elif defined(ARENA_MMAP) && defined(__linux__)
+    return madvise(base, size, MADV_DONTNEED) == 0;
+#elif defined(ARENA_MMAP) && defined(MADV_FREE)
+    return madvise(base, size, MADV_FREE) == 0;
+#elif defined(ARENA_MMAP)
+    return madvise(base, size, MADV_DONTNEED) == 0;
+#else
+    (void)base;
+    (void)size;
+    return 0;
+#endif
+}
+
+/* Whether pages_release() also zeroes the pages */
+#if defined(ARENA_MMAP) && defined(__linux__)
+#define RELEASE_WIPES 1
+#else
+#define RELEASE_WIPES 0
+#endif
+
+/***************Arenas (callers hold registry_lock)*****************/
+
+static void scrub_locked(argon2_arena *arena) {
+    if (arena->dirty) {
+        clear_internal_memory(arena->base, arena->resident);
+        arena->dirty = 0;
+    }
+}
+
+static size_t trim_locked(argon2_arena *arena, uint64_t idle_ns,
+                          uint64_t now) {
+    size_t released;
+
+    if (arena->busy || arena->resident == 0 ||
+        now - arena->last_use_ns < idle_ns) {
+        return 0;
+    }
+
+    if (!RELEASE_WIPES) {
+        scrub_locked(arena);
+    }
+    if (!pages_release(arena->base, arena->resident)) {
+        scrub_locked(arena);
+        return 0;
+    }
+    arena->dirty = 0;
+    released = arena->resident;
+    arena->resident = 0;
+    return released;
+}
+
+static void unmap_locked(argon2_arena *arena) {
+    if (arena->base != NULL) {
+        scrub_locked(arena);
+        pages_unmap(arena->base, arena->reserved);
+    }
+    arena->base = NULL;
+    arena->reserved = 0;
+    arena->resident = 0;
+}
+
+/***************Arena functions*****************/
+
+void arena_init(argon2_arena *arena) {
+    arena->base = NULL;
+    arena->reserved = 0;
+    arena->resident = 0;
+    arena->dirty = 0;
+    arena->busy = 0;
+    arena->orphaned = 0;
+    arena->last_use_ns = 0;
+    arena->prev = NULL;
+
+    argon2_mutex_lock(&registry_lock);
+    arena->next = registry;
+    if (registry != NULL) {
+        registry->prev = arena;
+    }
+    registry = arena;
+    argon2_mutex_unlock(&registry_lock);
+}
+
+int arena_reserve(argon2_arena *arena, size_t size) {
+    int result = ARGON2_OK;
+
+    argon2_mutex_lock(&registry_lock);
+    if (arena->reserved < size) {
+        unmap_locked(arena);
+        arena->base = pages_map(size);
+        if (arena->base == NULL) {
+            result = ARGON2_MEMORY_ALLOCATION_ERROR;
+        } else {
+            arena->reserved = size;
+        }
+    }
+    argon2_mutex_unlock(&registry_lock);
+    return result;
+}
+
+void arena_begin(argon2_arena *arena, size_t size, int dirty) {
+    argon2_mutex_lock(&registry_lock);
+    arena->busy = 1;
+    if (arena->resident < size) {
+        arena->resident = size;
+    }
+    if (dirty) {
+        arena->dirty = 1;
+    }
+    argon2_mutex_unlock(&registry_lock);
+}
+
+void arena_end(argon2_arena *arena) {
+    uint64_t now = monotonic_ns();
+
+    argon2_mutex_lock(&registry_lock);
+    arena->busy = 0;
+    arena->last_use_ns = now;
+    argon2_mutex_unlock(&registry_lock);
+}
+
+void arena_scrub(argon2_arena *arena) {
+    argon2_mutex_lock(&registry_lock);
+    scrub_locked(arena);
+    argon2_mutex_unlock(&registry_lock);
+}
+
+size_t arena_trim(argon2_arena *arena, uint64_t idle_ns) {
+    size_t released;
+    uint64_t now = monotonic_ns();
+
+    argon2_mutex_lock(&registry_lock);
+    released = trim_locked(arena, idle_ns, now);
+    argon2_mutex_unlock(&registry_lock);
+    return released;
+}
+
+void arena_destroy(argon2_arena *arena) {
+    argon2_mutex_lock(&registry_lock);
+    unmap_locked(arena);
+    if (arena->prev != NULL) {
+        arena->prev->next = arena->next;
+    } else {
+        registry = arena->next;
+    }
+    if (arena->next != NULL) {
+        arena->next->prev = arena->prev;
+    }
+    argon2_mutex_unlock(&registry_lock);
+}
+
+/***************Thread arena cache*****************/
+
+/* Byte cap (0 = disabled) and bytes reserved by cached arenas, guarded by
+   registry_lock. cache_enabled mirrors cache_limit != 0 and is read without
+   the lock, so that hashes skip the cache at no cost while it is off. */
+static size_t cache_limit = 0;
+static size_t cache_bytes = 0;
+static int cache_enabled = 0;
+
+static void cache_free(argon2_arena *arena) {
+    argon2_mutex_lock(&registry_lock);
+    cache_bytes -= arena->reserved;
+    argon2_mutex_unlock(&registry_lock);
+    arena_destroy(arena);
+    free(arena);
+}
+
+#if defined(ARGON2_NO_THREADS)
+
+static argon2_arena *cache_slot = NULL;
+static int cache_key_create(void) { return 0; }
+static argon2_arena *cache_key_get(void) { return cache_slot; }
+static int cache_key_set(argon2_arena *arena) {
+    cache_slot = arena;
+    return 0;
+}
+
+#else
+
+/* Thread exit: an arena still handed out is left to arena_cache_put() */
+static void cache_destroy(argon2_arena *arena) {
+    argon2_mutex_lock(&registry_lock);
+    if (arena->busy) {
+        arena->orphaned = 1;
+        argon2_mutex_unlock(&registry_lock);
+        return;
+    }
+    argon2_mutex_unlock(&registry_lock);
+    cache_free(arena);
+}
+
+#if defined(_WIN32)
+
+static DWORD cache_key = FLS_OUT_OF_INDEXES;
+static VOID WINAPI cache_key_destructor(PVOID arena) {
+    if (arena != NULL) {
+        cache_destroy(arena);
+    }
+}
+static int cache_key_create(void) {
+    if (cache_key == FLS_OUT_OF_INDEXES) {
+        cache_key = FlsAlloc(cache_key_destructor);
+    }
+    return cache_key == FLS_OUT_OF_INDEXES ? -1 : 0;
+}
+static argon2_arena *cache_key_get(void) {
+    return cache_key == FLS_OUT_OF_INDEXES ? NULL : FlsGetValue(cache_key);
+}
+static int cache_key_set(argon2_arena *arena) {
+    return FlsSetValue(cache_key, arena) ? 0 : -1;
+}
+
+#else
+
+static pthread_key_t cache_key;
+static int cache_key_created = 0;
+static void cache_key_destructor(void *arena) { cache_destroy(arena); }
+static int cache_key_create(void) {
+    if (!cache_key_created) {
+        if (pthread_key_create(&cache_key, cache_key_destructor) != 0) {
+            return -1;
+        }
+        cache_key_created = 1;
+    }
+    return 0;
+}
+static argon2_arena *cache_key_get(void) {
+    return cache_key_created ? pthread_getspecific(cache_key) : NULL;
+}
+static int cache_key_set(argon2_arena *arena) {
+    return pthread_setspecific(cache_key, arena);
+}
+
+#endif
+#endif /* ARGON2_NO_THREADS */
+
+uint8_t *arena_cache_get(size_t size, argon2_arena **owner) {
+    argon2_arena *arena;
+    size_t grow = 0;
+
+    if (!cache_enabled) {
+        return NULL;
+    }
+    argon2_mutex_lock(&registry_lock);
+    if (cache_limit == 0) {
+        argon2_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+    argon2_mutex_unlock(&registry_lock);
+
+    arena = cache_key_get();
+    if (arena == NULL) {
+        arena = malloc(sizeof(*arena));
+        if (arena == NULL) {
+            return NULL;
+        }
+        if (cache_key_set(arena) != 0) {
+            free(arena);
+            return NULL;
+        }
+        arena_init(arena);
+    }
+
+    /* Charge the growth against the cap before mapping anything */
+    argon2_mutex_lock(&registry_lock);
+    if (arena->busy) {
+        argon2_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+    if (arena->reserved < size) {
+        grow = size - arena->reserved;
+        if (cache_bytes + grow > cache_limit) {
+            argon2_mutex_unlock(&registry_lock);
+            return NULL;
+        }
+        cache_bytes += grow;
+    }
+    argon2_mutex_unlock(&registry_lock);
+
+    if (grow != 0 && arena_reserve(arena, size) != ARGON2_OK) {
+        /* The old mapping is gone as well */
+        argon2_mutex_lock(&registry_lock);
+        cache_bytes -= size;
+        argon2_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+
+    arena_begin(arena, size, 0);
+    *owner = arena;
+    return arena->base;
+}
+
+void arena_cache_put(argon2_arena *arena) {
+    int orphaned;
+
+    argon2_mutex_lock(&registry_lock);
+    orphaned = arena->orphaned;
+    argon2_mutex_unlock(&registry_lock);
+
+    if (orphaned) {
+        /* No thread will look this arena up again */
+        cache_free(arena);
+    } else {
+        arena_end(arena);
+    }
+}
+
+/***************Public interface*****************/
+
+int argon2_thread_cache_enable(size_t max_cached_bytes) {
+    int result = ARGON2_OK;
+
+    argon2_mutex_lock(&registry_lock);
+    if (max_cached_bytes != 0 && cache_key_create() != 0) {
+        result = ARGON2_THREAD_FAIL;
+    } else {
+        cache_limit = max_cached_bytes;
+        cache_enabled = max_cached_bytes != 0;
+    }
+    argon2_mutex_unlock(&registry_lock);
+    return result;
+}
+
+void argon2_get_memory_stats(argon2_memory_stats *stats) {
+    argon2_arena *arena;
+
+    if (stats == NULL) {
+        return;
+    }
+    stats->arenas = 0;
+    stats->reserved_bytes = 0;
+    stats->resident_bytes = 0;
+
+    argon2_mutex_lock(&registry_lock);
+    for (arena = registry; arena != NULL; arena = arena->next) {
+        stats->arenas++;
+        stats->reserved_bytes += arena->reserved;
+        stats->resident_bytes += arena->resident;
+    }
+    argon2_mutex_unlock(&registry_lock);
+}
+
+size_t argon2_arena_trim(uint64_t idle_ns) {
+    argon2_arena *arena;
+    size_t released = 0;
+    uint64_t now = monotonic_ns();
+
+    argon2_mutex_lock(&registry_lock);
+    for (arena = registry; arena != NULL; arena = arena->next) {
+        released += trim_locked(arena, idle_ns, now);
+    }
+    argon2_mutex_unlock(&registry_lock);
+    return released;
+}
@@ -0,0 +1,94 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef ARGON2_ARENA_H
+#define ARGON2_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pooled scratch memory that outlives a single hash (session buffers and the
+ * like). Arenas are mapped directly from the kernel where possible, so that
+ * an idle arena can hand its pages back while keeping its address range.
+ * All live arenas are linked in a registry, which feeds the memory
+ * statistics and lets argon2_arena_trim() find idle ones.
+ */
+typedef struct Argon2_arena {
+    uint8_t *base;          /* start of the mapping, NULL if none */
+    size_t reserved;        /* bytes mapped */
+    size_t resident;        /* bytes touched since the last trim */
+    int dirty;              /* holds unwiped blocks of an earlier hash */
+    int busy;               /* a hash is running in it, do not trim */
+    int orphaned;           /* its thread exited while busy, free on put */
+    uint64_t last_use_ns;   /* monotonic time the last hash finished */
+    struct Argon2_arena *prev, *next; /* registry links */
+} argon2_arena;
+
+/* Initializes an empty arena and links it into the registry */
+void arena_init(argon2_arena *arena);
+
+/*
+ * Makes sure the arena can hold @size bytes, replacing (and wiping) a smaller
+ * mapping
+ * @return ARGON2_OK, or ARGON2_MEMORY_ALLOCATION_ERROR
+ */
+int arena_reserve(argon2_arena *arena, size_t size);
+
+/*
+ * Marks the first @size bytes as about to be used by a hash. @dirty says
+ * whether the hash leaves its blocks behind for a later wipe.
+ */
+void arena_begin(argon2_arena *arena, size_t size, int dirty);
+
+/* Marks the hash started by arena_begin() as finished */
+void arena_end(argon2_arena *arena);
+
+/* Wipes the arena if it is dirty */
+void arena_scrub(argon2_arena *arena);
+
+/*
+ * Wipes the arena if needed and returns its pages to the kernel when it has
+ * been idle for at least @idle_ns nanoseconds.
+ * @return Number of resident bytes released
+ */
+size_t arena_trim(argon2_arena *arena, uint64_t idle_ns);
+
+/* Wipes and unmaps the arena, and unlinks it from the registry */
+void arena_destroy(argon2_arena *arena);
+
+/*
+ * Thread arena cache, enabled by argon2_thread_cache_enable(): each thread
+ * keeps one arena for the memory blocks of argon2_ctx() and friends.
+ */
+
+/*
+ * Returns the base of the calling thread's cached arena, grown to @size
+ * bytes, or NULL if the cache is disabled, busy, or growing it would exceed
+ * the byte cap
+ * @param owner Receives the arena to hand to arena_cache_put()
+ */
+uint8_t *arena_cache_get(size_t size, argon2_arena **owner);
+
+/*
+ * Gives back the memory of @arena obtained from arena_cache_get(), from any
+ * thread. The caller has wiped it. If the owning thread has exited in the
+ * meantime, the arena is destroyed here.
+ */
+void arena_cache_put(argon2_arena *arena);
+
+#endif
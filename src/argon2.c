@@ -20,8 +20,10 @@
 #include <stdio.h>
 
 #include "argon2.h"
+#include "arena.h"
 #include "encoding.h"
 #include "core.h"
+#include "metrics.h"
 
 const char *argon2_type2string(argon2_type type, int uppercase) {
     switch (type) {
@@ -36,67 +38,379 @@ const char *argon2_type2string(argon2_type type, int uppercase) {
     return NULL;
 }
 
-int argon2_ctx(argon2_context *context, argon2_type type) {
-    /* 1. Validate all inputs */
-    int result = validate_inputs(context);
+/* Number of memory blocks actually used for @m_cost and @lanes */
+static uint32_t argon2_memory_blocks(uint32_t m_cost, uint32_t lanes) {
     uint32_t memory_blocks, segment_length;
-    argon2_instance_t instance;
 
-    if (ARGON2_OK != result) {
-        return result;
+    /* Minimum memory_blocks = 8L blocks, where L is the number of lanes */
+    memory_blocks = m_cost;
+
+    if (memory_blocks < 2 * ARGON2_SYNC_POINTS * lanes) {
+        memory_blocks = 2 * ARGON2_SYNC_POINTS * lanes;
     }
 
+    segment_length = memory_blocks / (lanes * ARGON2_SYNC_POINTS);
+    /* Ensure that all segments have equal length */
+    return segment_length * (lanes * ARGON2_SYNC_POINTS);
+}
+
+/*
+ * Sets up @instance for a validated context. The blocks are allocated by
+ * initialize() unless @memory (suitably sized and aligned) is given;
+ * @defer_wipe leaves @memory unwiped for its session.
+ */
+static int argon2_setup(argon2_instance_t *instance, argon2_context *context,
+                        argon2_type type, uint8_t *memory, int defer_wipe) {
+    uint32_t memory_blocks, segment_length;
+
+    instance->start_ns = monotonic_ns();
+    instance->cache_arena = NULL;
+    instance->stepped = 0;
     if (Argon2_d != type && Argon2_i != type && Argon2_id != type) {
         return ARGON2_INCORRECT_TYPE;
     }
 
     /* 2. Align memory size */
-    /* Minimum memory_blocks = 8L blocks, where L is the number of lanes */
-    memory_blocks = context->m_cost;
+    memory_blocks = argon2_memory_blocks(context->m_cost, context->lanes);
+    segment_length = memory_blocks / (context->lanes * ARGON2_SYNC_POINTS);
 
-    if (memory_blocks < 2 * ARGON2_SYNC_POINTS * context->lanes) {
-        memory_blocks = 2 * ARGON2_SYNC_POINTS * context->lanes;
+    instance->version = context->version;
+    instance->memory = (block *)memory;
+    instance->caller_memory = memory != NULL;
+    instance->defer_wipe = defer_wipe;
+    instance->passes = context->t_cost;
+    instance->memory_blocks = memory_blocks;
+    instance->segment_length = segment_length;
+    instance->lane_length = segment_length * ARGON2_SYNC_POINTS;
+    instance->lanes = context->lanes;
+    instance->threads = context->threads;
+    instance->type = type;
+
+    if (instance->threads > instance->lanes) {
+        instance->threads = instance->lanes;
     }
+    /* Fewer threads than lanes do not change the output */
+    instance->threads = executor_threads(instance->threads);
+    return ARGON2_OK;
+}
 
-    segment_length = memory_blocks / (context->lanes * ARGON2_SYNC_POINTS);
-    /* Ensure that all segments have equal length */
-    memory_blocks = segment_length * (context->lanes * ARGON2_SYNC_POINTS);
-
-    instance.version = context->version;
-    instance.memory = NULL;
-    instance.passes = context->t_cost;
-    instance.memory_blocks = memory_blocks;
-    instance.segment_length = segment_length;
-    instance.lane_length = segment_length * ARGON2_SYNC_POINTS;
-    instance.lanes = context->lanes;
-    instance.threads = context->threads;
-    instance.type = type;
+/*
+ * Runs a validated context: initialization, memory filling and finalization.
+ * See argon2_setup() for @memory and @defer_wipe. The tag is written to
+ * context->out, or handed to @output_cbk if it is set.
+ */
+static int argon2_run(argon2_context *context, argon2_type type,
+                      uint8_t *memory, int defer_wipe,
+                      argon2_output_fptr output_cbk, void *arg) {
+    int result;
+    argon2_instance_t instance;
 
-    if (instance.threads > instance.lanes) {
-        instance.threads = instance.lanes;
+    result = argon2_setup(&instance, context, type, memory, defer_wipe);
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
     }
+    ARGON2_PROBE(ctx_entry, &instance);
 
     /* 3. Initialization: Hashing inputs, allocating memory, filling first
      * blocks
      */
     result = initialize(&instance, context);
 
+    if (ARGON2_OK == result) {
+        /* 4. Filling memory */
+        result = fill_memory_blocks(&instance);
+
+        if (ARGON2_OK != result) {
+            release_memory(context, &instance);
+        } else if (output_cbk != NULL) {
+            /* 5. Finalization */
+            result = finalize_stream(context, &instance, output_cbk, arg);
+        } else {
+            finalize(context, &instance);
+        }
+    }
+
+    ARGON2_PROBE1(ctx_return, &instance, result);
     if (ARGON2_OK != result) {
-        return result;
+        return metrics_failure(result);
     }
+    metrics_hash(context, type, monotonic_ns() - instance.start_ns);
+    return result;
+}
 
-    /* 4. Filling memory */
-    result = fill_memory_blocks(&instance);
+int argon2_ctx(argon2_context *context, argon2_type type) {
+    /* 1. Validate all inputs */
+    int result = validate_inputs(context);
 
     if (ARGON2_OK != result) {
-        return result;
+        return metrics_failure(result);
+    }
+
+    return argon2_run(context, type, NULL, 0, NULL, NULL);
+}
+
+int argon2_ctx_stream(argon2_context *context, argon2_type type,
+                      argon2_output_fptr output_cbk, void *arg) {
+    /* 1. Validate all inputs; context->out is not used */
+    int result = validate_parameters(context);
+
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
+    }
+
+    if (output_cbk == NULL) {
+        return metrics_failure(ARGON2_OUTPUT_PTR_NULL);
+    }
+
+    return argon2_run(context, type, NULL, 0, output_cbk, arg);
+}
+
+uint64_t argon2_monotonic_ns(void) { return monotonic_ns(); }
+
+struct Argon2_state {
+    argon2_context *context;
+    argon2_instance_t instance;
+    uint64_t next_segment;   /* segments filled so far */
+    uint64_t total_segments; /* passes * sync points * lanes */
+};
+
+int argon2_begin(argon2_context *context, argon2_type type,
+                 argon2_state **state) {
+    argon2_state *st;
+    /* 1. Validate all inputs */
+    int result = validate_inputs(context);
+
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
+    }
+
+    if (state == NULL) {
+        return metrics_failure(ARGON2_INCORRECT_PARAMETER);
+    }
+    *state = NULL;
+
+    st = (argon2_state *)malloc(sizeof(argon2_state));
+    if (st == NULL) {
+        return metrics_failure(ARGON2_MEMORY_ALLOCATION_ERROR);
+    }
+
+    /* Segments are filled one by one on the caller's thread */
+    result = argon2_setup(&st->instance, context, type, NULL, 0);
+    if (ARGON2_OK != result) {
+        free(st);
+        return metrics_failure(result);
+    }
+    ARGON2_PROBE(ctx_entry, &st->instance);
+
+    st->instance.threads = executor_threads(1);
+    /* Not from the thread cache: the state may move to other threads */
+    st->instance.stepped = 1;
+    result = initialize(&st->instance, context);
+    if (ARGON2_OK != result) {
+        ARGON2_PROBE1(ctx_return, &st->instance, result);
+        free(st);
+        return metrics_failure(result);
+    }
+
+    st->context = context;
+    st->next_segment = 0;
+    st->total_segments = (uint64_t)st->instance.passes * ARGON2_SYNC_POINTS *
+                         st->instance.lanes;
+    *state = st;
+    return ARGON2_OK;
+}
+
+int argon2_step(argon2_state *state, uint32_t max_segments) {
+    const argon2_instance_t *instance;
+    uint64_t n, per_pass;
+    uint32_t done, claim;
+    int result;
+
+    if (state == NULL) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
+    /* Same order as fill_memory_blocks(): pass, then slice, then lane */
+    instance = &state->instance;
+    per_pass = (uint64_t)ARGON2_SYNC_POINTS * instance->lanes;
+    claim = executor_claim(instance);
+    for (done = 0;
+         done < max_segments && state->next_segment < state->total_segments;
+         ++done, ++state->next_segment) {
+        argon2_position_t position;
+
+        result = check_cancel(instance);
+        if (ARGON2_OK != result) {
+            executor_unclaim(claim);
+            return result;
+        }
+
+        n = state->next_segment;
+        position.pass = (uint32_t)(n / per_pass);
+        position.slice = (uint8_t)(n % per_pass / instance->lanes);
+        position.lane = (uint32_t)(n % instance->lanes);
+        position.index = 0;
+        run_segment(instance, position);
+        if (position.lane == instance->lanes - 1) {
+            ARGON2_PROBE2(slice_done, instance, position.pass,
+                          position.slice);
+        }
+    }
+    executor_unclaim(claim);
+
+    return state->next_segment < state->total_segments ? 1 : ARGON2_OK;
+}
+
+int argon2_finish(argon2_state *state) {
+    int result;
+
+    if (state == NULL) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
+    /* Fill whatever the caller has not stepped through yet */
+    while ((result = argon2_step(state, UINT32_MAX)) > 0) {
     }
-    /* 5. Finalization */
-    finalize(context, &instance);
 
+    if (ARGON2_OK != result) {
+        release_memory(state->context, &state->instance);
+        ARGON2_PROBE1(ctx_return, &state->instance, result);
+        free(state);
+        return metrics_failure(result);
+    }
+
+    finalize(state->context, &state->instance);
+    ARGON2_PROBE1(ctx_return, &state->instance, ARGON2_OK);
+    metrics_hash(state->context, state->instance.type,
+                 monotonic_ns() - state->instance.start_ns);
+    free(state);
     return ARGON2_OK;
 }
 
+void argon2_abort(argon2_state *state) {
+    if (state != NULL) {
+        release_memory(state->context, &state->instance);
+        ARGON2_PROBE1(ctx_return, &state->instance, ARGON2_CANCELLED);
+        free(state);
+    }
+}
+
+/* Aligns a buffer sized by argon2_memory_required() for the memory blocks */
+static uint8_t *align_blocks(void *memory) {
+    uint8_t *blocks = (uint8_t *)memory;
+    size_t misalignment = (uintptr_t)blocks % ARGON2_MEMORY_ALIGNMENT;
+
+    /* The slack in argon2_memory_required() covers this */
+    if (misalignment != 0) {
+        blocks += ARGON2_MEMORY_ALIGNMENT - misalignment;
+    }
+    return blocks;
+}
+
+size_t argon2_memory_required(uint32_t m_cost, uint32_t lanes) {
+    uint32_t memory_blocks;
+
+    if (lanes == 0 || lanes > ARGON2_MAX_LANES) {
+        return 0;
+    }
+
+    memory_blocks = argon2_memory_blocks(m_cost, lanes);
+    if (memory_blocks > (SIZE_MAX - ARGON2_MEMORY_ALIGNMENT) / sizeof(block)) {
+        return 0;
+    }
+
+    return (size_t)memory_blocks * sizeof(block) + ARGON2_MEMORY_ALIGNMENT - 1;
+}
+
+int argon2_ctx_with_memory(argon2_context *context, argon2_type type,
+                           void *memory, size_t memory_len) {
+    size_t required;
+    /* 1. Validate all inputs */
+    int result = validate_inputs(context);
+
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
+    }
+
+    required = argon2_memory_required(context->m_cost, context->lanes);
+    if (memory == NULL || required == 0 || memory_len < required) {
+        return metrics_failure(ARGON2_MEMORY_BUFFER_TOO_SMALL);
+    }
+
+    return argon2_run(context, type, align_blocks(memory), 0, NULL, NULL);
+}
+
+struct Argon2_session {
+    argon2_arena arena; /* scratch buffer, aligned by align_blocks() */
+    uint32_t flags;     /* ARGON2_SESSION_* */
+};
+
+argon2_session *argon2_session_create(uint32_t flags) {
+    argon2_session *session = malloc(sizeof(*session));
+
+    if (session == NULL) {
+        return NULL;
+    }
+    arena_init(&session->arena);
+    session->flags = flags;
+    return session;
+}
+
+int argon2_session_ctx(argon2_session *session, argon2_context *context,
+                       argon2_type type) {
+    size_t required;
+    int defer_wipe;
+    /* 1. Validate all inputs */
+    int result = validate_inputs(context);
+
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
+    }
+
+    if (session == NULL) {
+        return metrics_failure(ARGON2_INCORRECT_PARAMETER);
+    }
+
+    required = argon2_memory_required(context->m_cost, context->lanes);
+    if (required == 0) {
+        return metrics_failure(ARGON2_MEMORY_ALLOCATION_ERROR);
+    }
+
+    /* 2. Grow the buffer; a smaller one is wiped before it is unmapped */
+    result = arena_reserve(&session->arena, required);
+    if (ARGON2_OK != result) {
+        return metrics_failure(result);
+    }
+
+    defer_wipe = (session->flags & ARGON2_SESSION_DEFER_WIPE) != 0;
+    arena_begin(&session->arena, required, defer_wipe);
+    result = argon2_run(context, type, align_blocks(session->arena.base),
+                        defer_wipe, NULL, NULL);
+    arena_end(&session->arena);
+    return result;
+}
+
+void argon2_session_scrub(argon2_session *session) {
+    if (session != NULL) {
+        arena_scrub(&session->arena);
+    }
+}
+
+int argon2_session_scrub_idle(argon2_session *session, uint64_t idle_ns) {
+    if (session == NULL) {
+        return 0;
+    }
+    return arena_trim(&session->arena, idle_ns) != 0;
+}
+
+void argon2_session_release(argon2_session *session) {
+    if (session == NULL) {
+        return;
+    }
+    arena_destroy(&session->arena);
+    free(session);
+}
+
 int argon2_hash(const uint32_t t_cost, const uint32_t m_cost,
                 const uint32_t parallelism, const void *pwd,
                 const size_t pwdlen, const void *salt, const size_t saltlen,
@@ -246,10 +560,122 @@ static int argon2_compare(const uint8_t *b1, const uint8_t *b2, size_t len) {
     return (int)((1 & ((d - 1) >> 8)) - 1);
 }
 
+int argon2_parse_encoded(argon2_parsed_hash *parsed, const char *encoded,
+                         argon2_type type) {
+    argon2_context ctx;
+    int ret;
+
+    if (parsed == NULL || encoded == NULL) {
+        return ARGON2_DECODING_FAIL;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.salt = parsed->salt;
+    ctx.saltlen = ARGON2_PARSED_SALT_MAX;
+    ctx.out = parsed->hash;
+    ctx.outlen = ARGON2_PARSED_HASH_MAX;
+
+    ret = decode_string(&ctx, encoded, type);
+    if (ret != ARGON2_OK) {
+        clear_internal_memory(parsed, sizeof(*parsed));
+        return ret;
+    }
+
+    parsed->type = type;
+    parsed->version = ctx.version;
+    parsed->m_cost = ctx.m_cost;
+    parsed->t_cost = ctx.t_cost;
+    parsed->lanes = ctx.lanes;
+    parsed->saltlen = ctx.saltlen;
+    parsed->hashlen = ctx.outlen;
+
+    return ARGON2_OK;
+}
+
+/* Verifies against a parsed hash, in @session's memory if it is not NULL */
+static int verify_parsed(argon2_session *session,
+                         const argon2_parsed_hash *parsed, const void *pwd,
+                         const size_t pwdlen) {
+    argon2_context ctx;
+    uint8_t out[ARGON2_PARSED_HASH_MAX];
+    int ret;
+
+    if (parsed == NULL) {
+        return ARGON2_DECODING_FAIL;
+    }
+
+    if (pwdlen > ARGON2_MAX_PWD_LENGTH) {
+        return ARGON2_PWD_TOO_LONG;
+    }
+
+    if (parsed->saltlen > ARGON2_PARSED_SALT_MAX) {
+        return ARGON2_SALT_TOO_LONG;
+    }
+
+    if (parsed->hashlen > ARGON2_PARSED_HASH_MAX) {
+        return ARGON2_OUTPUT_TOO_LONG;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = out;
+    ctx.outlen = parsed->hashlen;
+    ctx.pwd = (uint8_t *)pwd;
+    ctx.pwdlen = (uint32_t)pwdlen;
+    ctx.salt = (uint8_t *)parsed->salt;
+    ctx.saltlen = parsed->saltlen;
+    ctx.t_cost = parsed->t_cost;
+    ctx.m_cost = parsed->m_cost;
+    ctx.lanes = parsed->lanes;
+    ctx.threads = parsed->lanes;
+    ctx.version = parsed->version;
+    ctx.flags = ARGON2_DEFAULT_FLAGS;
+
+    if (session != NULL) {
+        ret = argon2_session_ctx(session, &ctx, parsed->type);
+    } else {
+        ret = argon2_ctx(&ctx, parsed->type);
+    }
+    if (ret == ARGON2_OK && argon2_compare(parsed->hash, out, ctx.outlen)) {
+        ret = ARGON2_VERIFY_MISMATCH;
+    }
+    metrics_verify(parsed->type, ret);
+
+    clear_internal_memory(out, sizeof(out));
+    return ret;
+}
+
+int argon2_verify_parsed(const argon2_parsed_hash *parsed, const void *pwd,
+                         const size_t pwdlen) {
+    return verify_parsed(NULL, parsed, pwd, pwdlen);
+}
+
+int argon2_session_verify(argon2_session *session, const char *encoded,
+                          const void *pwd, const size_t pwdlen,
+                          argon2_type type) {
+    argon2_parsed_hash parsed;
+    int ret;
+
+    if (session == NULL) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
+    ret = argon2_parse_encoded(&parsed, encoded, type);
+    if (ret == ARGON2_DECODING_FAIL) {
+        /* Too large for the inline buffers, or malformed */
+        return argon2_verify(encoded, pwd, pwdlen, type);
+    }
+    if (ret == ARGON2_OK) {
+        ret = verify_parsed(session, &parsed, pwd, pwdlen);
+    }
+    clear_internal_memory(&parsed, sizeof(parsed));
+    return ret;
+}
+
 int argon2_verify(const char *encoded, const void *pwd, const size_t pwdlen,
                   argon2_type type) {
 
     argon2_context ctx;
+    argon2_parsed_hash parsed;
     uint8_t *desired_result = NULL;
 
     int ret = ARGON2_OK;
@@ -265,6 +691,18 @@ int argon2_verify(const char *encoded, const void *pwd, const size_t pwdlen,
         return ARGON2_DECODING_FAIL;
     }
 
+    /* Hashes whose salt and tag fit the inline buffers need no allocation;
+       anything else is retried on the general path below */
+    ret = argon2_parse_encoded(&parsed, encoded, type);
+    if (ret != ARGON2_DECODING_FAIL) {
+        if (ret == ARGON2_OK) {
+            ret = argon2_verify_parsed(&parsed, pwd, pwdlen);
+        }
+        clear_internal_memory(&parsed, sizeof(parsed));
+        return ret;
+    }
+    ret = ARGON2_OK;
+
     encoded_len = strlen(encoded);
     if (encoded_len > UINT32_MAX) {
         return ARGON2_DECODING_FAIL;
@@ -285,6 +723,7 @@ int argon2_verify(const char *encoded, const void *pwd, const size_t pwdlen,
 
     ctx.pwd = (uint8_t *)pwd;
     ctx.pwdlen = (uint32_t)pwdlen;
+    ctx.flags = ARGON2_DEFAULT_FLAGS;
 
     ret = decode_string(&ctx, encoded, type);
     if (ret != ARGON2_OK) {
@@ -342,15 +781,14 @@ int argon2id_ctx(argon2_context *context) {
 int argon2_verify_ctx(argon2_context *context, const char *hash,
                       argon2_type type) {
     int ret = argon2_ctx(context, type);
-    if (ret != ARGON2_OK) {
-        return ret;
-    }
 
-    if (argon2_compare((uint8_t *)hash, context->out, context->outlen)) {
-        return ARGON2_VERIFY_MISMATCH;
+    if (ret == ARGON2_OK &&
+        argon2_compare((uint8_t *)hash, context->out, context->outlen)) {
+        ret = ARGON2_VERIFY_MISMATCH;
     }
+    metrics_verify(type, ret);
 
-    return ARGON2_OK;
+    return ret;
 }
 
 int argon2d_verify_ctx(argon2_context *context, const char *hash) {
@@ -439,11 +877,35 @@ const char *argon2_error_message(int error_code) {
         return "Some of encoded parameters are too long or too short";
     case ARGON2_VERIFY_MISMATCH:
         return "The password does not match the supplied hash";
+    case ARGON2_OUTPUT_CALLBACK_FAIL:
+        return "The output callback aborted";
+    case ARGON2_MEMORY_BUFFER_TOO_SMALL:
+        return "The memory buffer is too small";
+    case ARGON2_CANCELLED:
+        return "The hash was cancelled";
+    case ARGON2_DEADLINE_EXCEEDED:
+        return "The hash missed its deadline";
     default:
         return "Unknown error code";
     }
 }
 
+int argon2_encode_ctx(char *dst, size_t dst_len, argon2_context *context,
+                      argon2_type type) {
+    if (dst == NULL) {
+        return ARGON2_ENCODING_FAIL;
+    }
+    return encode_string(dst, dst_len, context, type);
+}
+
+int argon2_decode_ctx(argon2_context *context, const char *encoded,
+                      argon2_type type) {
+    if (context == NULL || encoded == NULL) {
+        return ARGON2_DECODING_FAIL;
+    }
+    return decode_string(context, encoded, type);
+}
+
 size_t argon2_encodedlen(uint32_t t_cost, uint32_t m_cost, uint32_t parallelism,
                          uint32_t saltlen, uint32_t hashlen, argon2_type type) {
   return strlen("$$v=$m=,t=,p=$$") + strlen(argon2_type2string(type, 0)) +
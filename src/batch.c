@@ -0,0 +1,379 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+#if defined(_WIN32) || defined(ARGON2_NO_THREADS)
+
+int batch(const batch_params *params) {
+    (void)params;
+    fprintf(stderr, "Error: -batch is not supported in this build\n");
+    return 1;
+}
+
+#else
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "encoding.h"
+
+/* Records in flight per worker: read ahead, being hashed or waiting their turn */
+#define BATCH_SLOTS_PER_WORKER 4
+
+#define BATCH_FREE 0
+#define BATCH_QUEUED 1
+#define BATCH_DONE 2
+
+typedef struct Batch_slot {
+    int state;
+    char *record;         /* getdelim() buffer, reused */
+    size_t record_cap;
+    ssize_t record_len;
+    char *result;         /* output line, without the newline */
+    size_t result_cap;
+} batch_slot;
+
+/*
+ * Reorder buffer: record n lives in slots[n % nslots] from the time it is
+ * read until it is written out, so the reader never gets more than nslots
+ * records ahead of the writer, and results come out in input order however
+ * the workers finish.
+ */
+typedef struct Batch_state {
+    const batch_params *params;
+    pthread_mutex_t lock; /* guards the fields below and the slot states */
+    pthread_cond_t work;     /* a record was queued, or input ended */
+    pthread_cond_t progress; /* a record was hashed or written out */
+    batch_slot *slots;
+    uint64_t nslots;
+    uint64_t next_read, next_job, next_write;
+    int eof;
+    uint64_t failed;
+} batch_state;
+
+/* Parses "m=N,t=N,p=N" (any subset, any order) into @context */
+static int parse_params(argon2_context *context, char *params) {
+    while (*params) {
+        char *end;
+        const char key = params[0];
+        unsigned long value;
+
+        if (params[1] != '=') {
+            return 0;
+        }
+        value = strtoul(params + 2, &end, 10);
+        if (end == params + 2 || (*end != ',' && *end != '\0') ||
+            value > UINT32_MAX) {
+            return 0;
+        }
+        switch (key) {
+        case 'm':
+            context->m_cost = (uint32_t)value;
+            break;
+        case 't':
+            context->t_cost = (uint32_t)value;
+            break;
+        case 'p':
+            context->lanes = context->threads = (uint32_t)value;
+            break;
+        default:
+            return 0;
+        }
+        params = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+static int grow(char **buf, size_t *cap, size_t len) {
+    if (*cap < len) {
+        char *grown = (char *)realloc(*buf, len);
+        if (!grown) {
+            return 0;
+        }
+        *buf = grown;
+        *cap = len;
+    }
+    return 1;
+}
+
+/* Hashes the record in @slot with @session, leaving the output line */
+static int hash_record(const batch_params *params, batch_slot *slot,
+                       argon2_session *session, uint8_t *out) {
+    argon2_context context;
+    char *salt, *costs;
+    size_t encodedlen;
+    int result;
+
+    memset(&context, 0, sizeof(context));
+    context.out = out;
+    context.outlen = params->outlen;
+    context.t_cost = params->t_cost;
+    context.m_cost = params->m_cost;
+    context.lanes = params->lanes;
+    context.threads = params->threads;
+    context.version = params->version;
+    context.flags = ARGON2_DEFAULT_FLAGS;
+
+    salt = memchr(slot->record, '\t', (size_t)slot->record_len);
+    if (!salt) {
+        result = ARGON2_DECODING_FAIL;
+        goto fail;
+    }
+    *salt++ = '\0';
+    costs = strchr(salt, '\t');
+    if (costs) {
+        *costs++ = '\0';
+        if (!parse_params(&context, costs)) {
+            result = ARGON2_DECODING_FAIL;
+            goto fail;
+        }
+    }
+    context.pwd = (uint8_t *)slot->record;
+    context.pwdlen = (uint32_t)(salt - 1 - slot->record);
+    context.salt = (uint8_t *)salt;
+    context.saltlen = (uint32_t)strlen(salt);
+
+    encodedlen = argon2_encodedlen(context.t_cost, context.m_cost,
+                                   context.lanes, context.saltlen,
+                                   context.outlen, params->type);
+    if (!grow(&slot->result, &slot->result_cap, encodedlen)) {
+        result = ARGON2_MEMORY_ALLOCATION_ERROR;
+        goto fail;
+    }
+
+    result = argon2_session_ctx(session, &context, params->type);
+    if (result == ARGON2_OK) {
+        result = encode_string(slot->result, slot->result_cap, &context,
+                               params->type);
+    }
+    clear_internal_memory(out, params->outlen);
+
+fail:
+    clear_internal_memory(slot->record, (size_t)slot->record_len);
+    if (result != ARGON2_OK &&
+        grow(&slot->result, &slot->result_cap, 128)) {
+        sprintf(slot->result, "error: %.100s", argon2_error_message(result));
+    }
+    return result;
+}
+
+static void *batch_worker(void *arg) {
+    batch_state *state = (batch_state *)arg;
+    const batch_params *params = state->params;
+    argon2_session *session = argon2_session_create(0);
+    uint8_t *out = (uint8_t *)malloc(params->outlen);
+
+    for (;;) {
+        batch_slot *slot;
+        int result;
+
+        pthread_mutex_lock(&state->lock);
+        while (state->next_job == state->next_read && !state->eof) {
+            pthread_cond_wait(&state->work, &state->lock);
+        }
+        if (state->next_job == state->next_read) {
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        slot = &state->slots[state->next_job++ % state->nslots];
+        pthread_mutex_unlock(&state->lock);
+
+        if (session && out) {
+            result = hash_record(params, slot, session, out);
+        } else {
+            clear_internal_memory(slot->record, (size_t)slot->record_len);
+            result = ARGON2_MEMORY_ALLOCATION_ERROR;
+            if (grow(&slot->result, &slot->result_cap, 128)) {
+                sprintf(slot->result, "error: %s",
+                        argon2_error_message(result));
+            }
+        }
+
+        pthread_mutex_lock(&state->lock);
+        slot->state = BATCH_DONE;
+        if (result != ARGON2_OK) {
+            state->failed++;
+        }
+        pthread_cond_broadcast(&state->progress);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    if (session) {
+        argon2_session_release(session);
+    }
+    free(out);
+    return NULL;
+}
+
+/* The next record to write out is hashed */
+static int writable(const batch_state *state) {
+    return state->next_write != state->next_read &&
+           state->slots[state->next_write % state->nslots].state == BATCH_DONE;
+}
+
+static void *batch_writer(void *arg) {
+    batch_state *state = (batch_state *)arg;
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        if (writable(state)) {
+            batch_slot *slot = &state->slots[state->next_write % state->nslots];
+            pthread_mutex_unlock(&state->lock);
+            puts(slot->result ? slot->result : "error: out of memory");
+            pthread_mutex_lock(&state->lock);
+            slot->state = BATCH_FREE;
+            state->next_write++;
+            pthread_cond_broadcast(&state->progress);
+        } else if (state->next_write == state->next_read && state->eof) {
+            break;
+        } else {
+            /* Push out what is buffered before waiting for the next one */
+            pthread_mutex_unlock(&state->lock);
+            fflush(stdout);
+            pthread_mutex_lock(&state->lock);
+            if (!writable(state) &&
+                !(state->next_write == state->next_read && state->eof)) {
+                pthread_cond_wait(&state->progress, &state->lock);
+            }
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    fflush(stdout);
+    return NULL;
+}
+
+int batch(const batch_params *params) {
+    batch_state state;
+    pthread_t writer, *workers;
+    uint32_t nworkers = params->workers, started, i;
+    long cpus;
+
+    if (nworkers == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.params = params;
+    state.nslots = (uint64_t)nworkers * BATCH_SLOTS_PER_WORKER;
+    state.slots = (batch_slot *)calloc((size_t)state.nslots, sizeof(batch_slot));
+    workers = (pthread_t *)malloc(nworkers * sizeof(pthread_t));
+    if (!state.slots || !workers) {
+        free(state.slots);
+        free(workers);
+        fprintf(stderr, "Error: %s\n",
+                argon2_error_message(ARGON2_MEMORY_ALLOCATION_ERROR));
+        return 1;
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.work, NULL);
+    pthread_cond_init(&state.progress, NULL);
+
+    for (started = 0; started < nworkers; ++started) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &state)) {
+            break;
+        }
+    }
+    if (started == 0 || pthread_create(&writer, NULL, batch_writer, &state)) {
+        fprintf(stderr, "Error: %s\n",
+                argon2_error_message(ARGON2_THREAD_FAIL));
+        pthread_mutex_lock(&state.lock);
+        state.eof = 1;
+        pthread_cond_broadcast(&state.work);
+        pthread_mutex_unlock(&state.lock);
+        for (i = 0; i < started; ++i) {
+            pthread_join(workers[i], NULL);
+        }
+        free(state.slots);
+        free(workers);
+        return 1;
+    }
+
+    /* Read records into free slots until stdin runs out */
+    for (;;) {
+        batch_slot *slot = &state.slots[state.next_read % state.nslots];
+
+        pthread_mutex_lock(&state.lock);
+        while (slot->state != BATCH_FREE) {
+            pthread_cond_wait(&state.progress, &state.lock);
+        }
+        pthread_mutex_unlock(&state.lock);
+
+        slot->record_len = getdelim(&slot->record, &slot->record_cap,
+                                    params->delimiter, stdin);
+        if (slot->record_len < 0) {
+            break;
+        }
+        if (slot->record_len > 0 &&
+            slot->record[slot->record_len - 1] == (char)params->delimiter) {
+            slot->record[--slot->record_len] = '\0';
+            /* CRLF line ends: the CR is not part of the salt or costs */
+            if (params->delimiter == '\n' && slot->record_len > 0 &&
+                slot->record[slot->record_len - 1] == '\r') {
+                slot->record[--slot->record_len] = '\0';
+            }
+        }
+
+        pthread_mutex_lock(&state.lock);
+        slot->state = BATCH_QUEUED;
+        state.next_read++;
+        pthread_cond_signal(&state.work);
+        pthread_mutex_unlock(&state.lock);
+    }
+
+    pthread_mutex_lock(&state.lock);
+    state.eof = 1;
+    pthread_cond_broadcast(&state.work);
+    pthread_cond_broadcast(&state.progress);
+    pthread_mutex_unlock(&state.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    for (i = 0; i < state.nslots; ++i) {
+        if (state.slots[i].record) {
+            clear_internal_memory(state.slots[i].record,
+                                  state.slots[i].record_cap);
+        }
+        free(state.slots[i].record);
+        free(state.slots[i].result);
+    }
+    free(state.slots);
+    free(workers);
+    pthread_cond_destroy(&state.work);
+    pthread_cond_destroy(&state.progress);
+    pthread_mutex_destroy(&state.lock);
+
+    if (state.failed) {
+        fprintf(stderr, "Error: %lu of %lu records failed\n",
+                (unsigned long)state.failed, (unsigned long)state.next_read);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
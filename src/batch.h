@@ -0,0 +1,56 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef ARGON2_BATCH_H
+#define ARGON2_BATCH_H
+
+#include <stdint.h>
+
+#include "argon2.h"
+
+/*
+ * Batch mode of the argon2 utility (argon2 -batch). Each record on stdin is
+ *
+ *   password TAB salt [TAB params]
+ *
+ * terminated by a newline (a CR before it is dropped), or by a NUL byte with
+ * -0 (so that passwords may contain newlines and carriage returns). params
+ * overrides the command line costs for that record as in an encoded hash,
+ * e.g. "m=65536,t=3,p=4". One line is written to stdout per record, in input
+ * order: the encoded hash, or "error: " and the reason.
+ */
+
+/* Defaults for the records and how to run them */
+typedef struct Batch_params {
+    argon2_type type;
+    uint32_t t_cost;
+    uint32_t m_cost;
+    uint32_t lanes;
+    uint32_t threads;
+    uint32_t outlen;
+    uint32_t version;
+    uint32_t workers; /* records hashed at once, 0 for one per CPU */
+    int delimiter;    /* '\n' or '\0' */
+} batch_params;
+
+/*
+ * Hashes every record on stdin
+ * @return 0 if all records were hashed, 1 otherwise
+ */
+int batch(const batch_params *params);
+
+#endif
@@ -25,6 +25,8 @@
 #endif
 
 #include "argon2.h"
+#include "core.h"
+#include "thread.h"
 
 static uint64_t rdtsc(void) {
 #ifdef _WIN32
@@ -105,7 +107,303 @@ static void benchmark() {
     }
 }
 
-int main() {
-    benchmark();
+/*
+ * Roofline mode: STREAM-like read, write and copy kernels give the memory
+ * bandwidth the host can actually sustain at each thread count, and every
+ * Argon2 run is reported as a share of it. Arrays are far larger than any
+ * last-level cache so that the kernels measure DRAM, not cache.
+ */
+#define ROOFLINE_ARRAY_BYTES ((size_t)1 << 27) /* 128 MiB */
+#define ROOFLINE_REPEAT 5
+#define ROOFLINE_THREADS 4 /* 1, 2, 4 and 8 threads, as in benchmark() */
+#define ROOFLINE_MAX_THREADS 8
+
+#define STREAM_READ 0
+#define STREAM_WRITE 1
+#define STREAM_COPY 2
+#define STREAM_KERNELS 3
+
+static const char *const stream_names[STREAM_KERNELS] = {"read", "write",
+                                                         "copy"};
+
+typedef struct Stream_job {
+    uint64_t *a, *b; /* this thread's share of the arrays */
+    size_t words;
+    int kernel;
+    uint64_t sum;
+} stream_job;
+
+/* Keeps the read kernel from being optimized out */
+static volatile uint64_t stream_sink;
+
+static void stream_run(stream_job *job) {
+    uint64_t *a = job->a, *b = job->b, sum = 0;
+    size_t i;
+
+    switch (job->kernel) {
+    case STREAM_READ:
+        for (i = 0; i < job->words; ++i) {
+            sum += a[i];
+        }
+        break;
+    case STREAM_WRITE:
+        for (i = 0; i < job->words; ++i) {
+            a[i] = (uint64_t)i;
+        }
+        break;
+    default:
+        for (i = 0; i < job->words; ++i) {
+            b[i] = a[i];
+        }
+        break;
+    }
+    job->sum = sum;
+}
+
+#if !defined(ARGON2_NO_THREADS)
+#ifdef _WIN32
+static unsigned __stdcall stream_thr(void *job)
+#else
+static void *stream_thr(void *job)
+#endif
+{
+    stream_run((stream_job *)job);
+    argon2_thread_exit();
+    return 0;
+}
+#endif
+
+/*
+ * Runs @kernel on @threads threads, each over its own slice of the arrays
+ * @return The best bandwidth of ROOFLINE_REPEAT runs in bytes per second,
+ * counting a copy as one read and one write
+ */
+static double stream_bandwidth(uint64_t *a, uint64_t *b, uint32_t threads,
+                               int kernel) {
+    const size_t words = ROOFLINE_ARRAY_BYTES / sizeof(uint64_t) / threads;
+    const double bytes = (double)words * threads * sizeof(uint64_t) *
+                         (kernel == STREAM_COPY ? 2 : 1);
+    stream_job jobs[ROOFLINE_MAX_THREADS];
+    double best = 0;
+    unsigned r;
+    uint32_t i;
+
+    for (r = 0; r < ROOFLINE_REPEAT; ++r) {
+        uint64_t start = argon2_monotonic_ns(), elapsed;
+#if !defined(ARGON2_NO_THREADS)
+        argon2_thread_handle_t handles[ROOFLINE_MAX_THREADS];
+#endif
+
+        for (i = 0; i < threads; ++i) {
+            jobs[i].a = a + i * words;
+            jobs[i].b = b + i * words;
+            jobs[i].words = words;
+            jobs[i].kernel = kernel;
+        }
+#if defined(ARGON2_NO_THREADS)
+        for (i = 0; i < threads; ++i) {
+            stream_run(&jobs[i]);
+        }
+#else
+        for (i = 1; i < threads; ++i) {
+            argon2_thread_create(&handles[i], &stream_thr, &jobs[i]);
+        }
+        stream_run(&jobs[0]);
+        for (i = 1; i < threads; ++i) {
+            argon2_thread_join(handles[i]);
+        }
+#endif
+        elapsed = argon2_monotonic_ns() - start;
+        for (i = 0; i < threads; ++i) {
+            stream_sink += jobs[i].sum;
+        }
+        if (elapsed > 0 && bytes * 1e9 / elapsed > best) {
+            best = bytes * 1e9 / elapsed;
+        }
+    }
+    return best;
+}
+
+/*
+ * Bytes an Argon2 run moves to and from memory. Filling a block reads the
+ * reference block and writes the new one; from the second pass on it also
+ * reads the block being overwritten, which it XORs in. The previous block
+ * was just written and is still in cache, so it is not counted.
+ */
+static double argon2_bytes(uint32_t t_cost, uint32_t m_cost, uint32_t lanes) {
+    const uint32_t blocks =
+        m_cost / (ARGON2_SYNC_POINTS * lanes) * (ARGON2_SYNC_POINTS * lanes);
+    return (double)blocks * ARGON2_BLOCK_SIZE * (2 + 3 * (t_cost - 1));
+}
+
+static void roofline() {
+#define BENCH_OUTLEN 16
+#define BENCH_INLEN 16
+    unsigned char out[BENCH_OUTLEN];
+    unsigned char pwd_array[BENCH_INLEN];
+    unsigned char salt_array[BENCH_INLEN];
+
+    const uint32_t t_cost = 3;
+    const uint32_t thread_test[ROOFLINE_THREADS] = {1, 2, 4, 8};
+    argon2_type types[3] = {Argon2_i, Argon2_d, Argon2_id};
+    double copy_bw[ROOFLINE_THREADS];
+    uint64_t *a, *b;
+    uint32_t m_cost;
+    unsigned i, j;
+    int k;
+
+    a = (uint64_t *)malloc(ROOFLINE_ARRAY_BYTES);
+    b = (uint64_t *)malloc(ROOFLINE_ARRAY_BYTES);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        printf("%s\n", argon2_error_message(ARGON2_MEMORY_ALLOCATION_ERROR));
+        return;
+    }
+    memset(a, 1, ROOFLINE_ARRAY_BYTES);
+    memset(b, 2, ROOFLINE_ARRAY_BYTES);
+
+    printf("Memory bandwidth, best of %d over %u MiB arrays:\n",
+           ROOFLINE_REPEAT, (unsigned)(ROOFLINE_ARRAY_BYTES >> 20));
+    for (i = 0; i < ROOFLINE_THREADS; ++i) {
+        printf("%u threads:", thread_test[i]);
+        for (k = 0; k < STREAM_KERNELS; ++k) {
+            const double bw = stream_bandwidth(a, b, thread_test[i], k);
+            printf("  %s %6.2f GB/s", stream_names[k], bw / 1e9);
+            if (k == STREAM_COPY) {
+                copy_bw[i] = bw;
+            }
+        }
+        printf("\n");
+    }
+    printf("\n");
+    free(a);
+    free(b);
+
+    memset(pwd_array, 0, BENCH_INLEN);
+    memset(salt_array, 1, BENCH_INLEN);
+
+    /* Sizes that no cache holds, so the copy bandwidth is the roof */
+    for (m_cost = (uint32_t)1 << 16; m_cost <= (uint32_t)1 << 20; m_cost *= 2) {
+        for (i = 0; i < ROOFLINE_THREADS; ++i) {
+            for (j = 0; j < 3; ++j) {
+                const uint64_t start = argon2_monotonic_ns();
+                double seconds, bw;
+
+                argon2_hash(t_cost, m_cost, thread_test[i], pwd_array,
+                            BENCH_INLEN, salt_array, BENCH_INLEN, out,
+                            BENCH_OUTLEN, NULL, 0, types[j],
+                            ARGON2_VERSION_NUMBER);
+
+                seconds = (double)(argon2_monotonic_ns() - start) / 1e9;
+                bw = argon2_bytes(t_cost, m_cost, thread_test[i]) / seconds;
+                printf("%s %d iterations  %d MiB %d threads:  %6.2f GB/s "
+                       "%5.1f%% of copy bandwidth\n",
+                       argon2_type2string(types[j], 1), t_cost, m_cost >> 10,
+                       thread_test[i], bw / 1e9, 100 * bw / copy_bw[i]);
+            }
+        }
+        printf("\n");
+    }
+#undef BENCH_INLEN
+#undef BENCH_OUTLEN
+}
+
+/* Smallest distance bucket holding the @q-th fraction of the references */
+static unsigned distance_percentile(const argon2_locality_stats *stats,
+                                    double q) {
+    uint64_t seen = 0;
+    unsigned k;
+
+    for (k = 0; k < ARGON2_LOCALITY_BUCKETS; ++k) {
+        seen += stats->distance[k];
+        if (seen > 0 && (double)seen >= q * stats->refs) {
+            break;
+        }
+    }
+    return k;
+}
+
+/*
+ * Locality mode: runs each type once with the given parameters and prints
+ * the reference statistics of every pass and slice. Needs a library built
+ * with make TRACE_LOCALITY=1.
+ */
+static int locality(uint32_t t_cost, uint32_t m_cost, uint32_t lanes) {
+    unsigned char out[16], pwd_array[16], salt_array[16];
+    argon2_type types[3] = {Argon2_i, Argon2_d, Argon2_id};
+    argon2_locality_stats stats;
+    unsigned j;
+
+    if (!argon2_get_locality_stats(Argon2_i, 0, 0, &stats)) {
+        printf("Reference statistics are not collected; rebuild with "
+               "make TRACE_LOCALITY=1\n");
+        return 1;
+    }
+    memset(pwd_array, 0, sizeof(pwd_array));
+    memset(salt_array, 1, sizeof(salt_array));
+
+    for (j = 0; j < 3; ++j) {
+        uint32_t pass, slice;
+        int result;
+
+        argon2_reset_locality_stats();
+        result = argon2_hash(t_cost, m_cost, lanes, pwd_array,
+                             sizeof(pwd_array), salt_array, sizeof(salt_array),
+                             out, sizeof(out), NULL, 0, types[j],
+                             ARGON2_VERSION_NUMBER);
+        if (result != ARGON2_OK) {
+            printf("%s\n", argon2_error_message(result));
+            return 1;
+        }
+
+        printf("%s %u iterations  %u MiB %u lanes\n",
+               argon2_type2string(types[j], 1), t_cost, m_cost >> 10, lanes);
+        printf("pass slice     refs  cross-lane  log2 distance p10/p50/p90"
+               "  pages/segment 4K     2M\n");
+        for (pass = 0; pass < t_cost && pass < ARGON2_LOCALITY_PASSES;
+             ++pass) {
+            for (slice = 0; slice < ARGON2_SYNC_POINTS; ++slice) {
+                argon2_get_locality_stats(types[j], pass, slice, &stats);
+                if (stats.segments == 0 || stats.refs == 0) {
+                    continue;
+                }
+                printf("%3u%s %5u %9lu  %9.1f%%  %12u/%2u/%2u %19.1f %6.1f\n",
+                       pass, pass == ARGON2_LOCALITY_PASSES - 1 ? "+" : " ",
+                       slice, (unsigned long)stats.refs,
+                       100.0 * stats.cross_lane / stats.refs,
+                       distance_percentile(&stats, 0.1),
+                       distance_percentile(&stats, 0.5),
+                       distance_percentile(&stats, 0.9),
+                       (double)stats.pages_4k / stats.segments,
+                       (double)stats.pages_2m / stats.segments);
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "-roofline") == 0) {
+        roofline();
+    } else if (argc > 1 && strcmp(argv[1], "-locality") == 0) {
+        /* Defaults to 3 iterations, 64 MiB and 4 lanes */
+        uint32_t t_cost = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 3;
+        uint32_t log_m = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 16;
+        uint32_t lanes = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 10) : 4;
+        if (log_m >= 32) {
+            printf("bad memory size\n");
+            return 1;
+        }
+        return locality(t_cost, (uint32_t)1 << log_m, lanes);
+    } else if (argc > 1) {
+        printf("Usage:  %s [-roofline | -locality [iterations "
+               "[log2(memory in KiB) [lanes]]]]\n",
+               argv[0]);
+        return 1;
+    } else {
+        benchmark();
+    }
     return ARGON2_OK;
 }
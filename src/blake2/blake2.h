@@ -80,6 +80,14 @@ ARGON2_LOCAL int blake2b(void *out, size_t outlen, const void *in, size_t inlen,
 
 /* Argon2 Team - Begin Code */
 ARGON2_LOCAL int blake2b_long(void *out, size_t outlen, const void *in, size_t inlen);
+/* Produces the same output as blake2b_long, handing it to @output in chunks
+ * of at most BLAKE2B_OUTBYTES bytes instead of writing it to a buffer.
+ * Returns 0 on success, -1 on error, or the first non-zero value returned by
+ * @output. If @output_failed is not NULL, it is set to whether the non-zero
+ * value came from @output. */
+ARGON2_LOCAL int blake2b_long_stream(argon2_output_fptr output, void *arg,
+                                     size_t outlen, const void *in,
+                                     size_t inlen, int *output_failed);
 /* Argon2 Team - End Code */
 
 #if defined(__cplusplus)
@@ -163,6 +163,182 @@ int blake2b_init_key(blake2b_state *S, size_t outlen, const void *key,
     return 0;
 }
 
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+/*
+ * Row-vectorized compression: the sixteen working words live in four
+ * 256-bit registers (one per row of the 4x4 state), so each half of a
+ * round runs the four column (resp. diagonal) G functions in parallel.
+ */
+#define B2B_ROT32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define B2B_ROT24(x)                                                           \
+    _mm256_shuffle_epi8((x), _mm256_setr_epi8(                                 \
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,                  \
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define B2B_ROT16(x)                                                           \
+    _mm256_shuffle_epi8((x), _mm256_setr_epi8(                                 \
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,                  \
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define B2B_ROT63(x)                                                           \
+    _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+#define B2B_LOADMSG(s, i0, i1, i2, i3)                                         \
+    _mm256_set_epi64x((long long)m[(s)[i3]], (long long)m[(s)[i2]],            \
+                      (long long)m[(s)[i1]], (long long)m[(s)[i0]])
+
+#define B2B_G(a, b, c, d, m0, m1)                                              \
+    do {                                                                       \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), m0);                      \
+        d = B2B_ROT32(_mm256_xor_si256(d, a));                                 \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = B2B_ROT24(_mm256_xor_si256(b, c));                                 \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), m1);                      \
+        d = B2B_ROT16(_mm256_xor_si256(d, a));                                 \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = B2B_ROT63(_mm256_xor_si256(b, c));                                 \
+    } while ((void)0, 0)
+
+static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
+    uint64_t m[16];
+    __m256i a, b, c, d, h0, h1;
+    unsigned int i, r;
+
+    for (i = 0; i < 16; ++i) {
+        m[i] = load64(block + i * sizeof(m[i]));
+    }
+
+    h0 = _mm256_loadu_si256((const __m256i *)&S->h[0]);
+    h1 = _mm256_loadu_si256((const __m256i *)&S->h[4]);
+    a = h0;
+    b = h1;
+    c = _mm256_loadu_si256((const __m256i *)&blake2b_IV[0]);
+    d = _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i *)&blake2b_IV[4]),
+        _mm256_set_epi64x((long long)S->f[1], (long long)S->f[0],
+                          (long long)S->t[1], (long long)S->t[0]));
+
+    for (r = 0; r < 12; ++r) {
+        const unsigned int *s = blake2b_sigma[r];
+
+        /* Columns */
+        B2B_G(a, b, c, d, B2B_LOADMSG(s, 0, 2, 4, 6),
+              B2B_LOADMSG(s, 1, 3, 5, 7));
+
+        /* Diagonalize */
+        b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+        c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+        d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+
+        B2B_G(a, b, c, d, B2B_LOADMSG(s, 8, 10, 12, 14),
+              B2B_LOADMSG(s, 9, 11, 13, 15));
+
+        /* Undiagonalize */
+        b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+        c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+        d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    _mm256_storeu_si256((__m256i *)&S->h[0],
+                        _mm256_xor_si256(h0, _mm256_xor_si256(a, c)));
+    _mm256_storeu_si256((__m256i *)&S->h[4],
+                        _mm256_xor_si256(h1, _mm256_xor_si256(b, d)));
+}
+
+#undef B2B_ROT32
+#undef B2B_ROT24
+#undef B2B_ROT16
+#undef B2B_ROT63
+#undef B2B_LOADMSG
+#undef B2B_G
+
+#elif defined(__VSX__) && defined(__LITTLE_ENDIAN__)
+
+#include "blamka-round-vsx.h"
+
+/*
+ * Same layout as the SSE2 BlaMka kernel: each row of the 4x4 state is
+ * split over two vectors, and DIAGONALIZE_VSX/UNDIAGONALIZE_VSX give
+ * exactly the BLAKE2b diagonal word order.
+ */
+#define B2B_LOADMSG(s, i0, i1) ((v2du){m[(s)[i0]], m[(s)[i1]]})
+
+#define B2B_G_VSX(A0, B0, C0, D0, A1, B1, C1, D1, M0, M1, M2, M3)            \
+    do {                                                                       \
+        A0 = vec_add(vec_add(A0, B0), M0);                                     \
+        A1 = vec_add(vec_add(A1, B1), M1);                                     \
+        D0 = VSX_ROTI_EPI64(vec_xor(D0, A0), -32);                             \
+        D1 = VSX_ROTI_EPI64(vec_xor(D1, A1), -32);                             \
+        C0 = vec_add(C0, D0);                                                  \
+        C1 = vec_add(C1, D1);                                                  \
+        B0 = VSX_ROTI_EPI64(vec_xor(B0, C0), -24);                             \
+        B1 = VSX_ROTI_EPI64(vec_xor(B1, C1), -24);                             \
+        A0 = vec_add(vec_add(A0, B0), M2);                                     \
+        A1 = vec_add(vec_add(A1, B1), M3);                                     \
+        D0 = VSX_ROTI_EPI64(vec_xor(D0, A0), -16);                             \
+        D1 = VSX_ROTI_EPI64(vec_xor(D1, A1), -16);                             \
+        C0 = vec_add(C0, D0);                                                  \
+        C1 = vec_add(C1, D1);                                                  \
+        B0 = VSX_ROTI_EPI64(vec_xor(B0, C0), -63);                             \
+        B1 = VSX_ROTI_EPI64(vec_xor(B1, C1), -63);                             \
+    } while ((void)0, 0)
+
+static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
+    uint64_t m[16];
+    v2du A0, A1, B0, B1, C0, C1, D0, D1;
+    unsigned int i, r;
+
+    for (i = 0; i < 16; ++i) {
+        m[i] = load64(block + i * sizeof(m[i]));
+    }
+
+    A0 = vec_xl(0, (const unsigned long long *)&S->h[0]);
+    A1 = vec_xl(0, (const unsigned long long *)&S->h[2]);
+    B0 = vec_xl(0, (const unsigned long long *)&S->h[4]);
+    B1 = vec_xl(0, (const unsigned long long *)&S->h[6]);
+    C0 = vec_xl(0, (const unsigned long long *)&blake2b_IV[0]);
+    C1 = vec_xl(0, (const unsigned long long *)&blake2b_IV[2]);
+    D0 = vec_xor(vec_xl(0, (const unsigned long long *)&blake2b_IV[4]),
+                 vec_xl(0, (const unsigned long long *)&S->t[0]));
+    D1 = vec_xor(vec_xl(0, (const unsigned long long *)&blake2b_IV[6]),
+                 vec_xl(0, (const unsigned long long *)&S->f[0]));
+
+    for (r = 0; r < 12; ++r) {
+        const unsigned int *s = blake2b_sigma[r];
+
+        B2B_G_VSX(A0, B0, C0, D0, A1, B1, C1, D1,
+                  B2B_LOADMSG(s, 0, 2), B2B_LOADMSG(s, 4, 6),
+                  B2B_LOADMSG(s, 1, 3), B2B_LOADMSG(s, 5, 7));
+
+        DIAGONALIZE_VSX(A0, B0, C0, D0, A1, B1, C1, D1);
+
+        B2B_G_VSX(A0, B0, C0, D0, A1, B1, C1, D1,
+                  B2B_LOADMSG(s, 8, 10), B2B_LOADMSG(s, 12, 14),
+                  B2B_LOADMSG(s, 9, 11), B2B_LOADMSG(s, 13, 15));
+
+        UNDIAGONALIZE_VSX(A0, B0, C0, D0, A1, B1, C1, D1);
+    }
+
+    vec_xst(vec_xor(vec_xl(0, (const unsigned long long *)&S->h[0]),
+                    vec_xor(A0, C0)),
+            0, (unsigned long long *)&S->h[0]);
+    vec_xst(vec_xor(vec_xl(0, (const unsigned long long *)&S->h[2]),
+                    vec_xor(A1, C1)),
+            0, (unsigned long long *)&S->h[2]);
+    vec_xst(vec_xor(vec_xl(0, (const unsigned long long *)&S->h[4]),
+                    vec_xor(B0, D0)),
+            0, (unsigned long long *)&S->h[4]);
+    vec_xst(vec_xor(vec_xl(0, (const unsigned long long *)&S->h[6]),
+                    vec_xor(B1, D1)),
+            0, (unsigned long long *)&S->h[6]);
+}
+
+#undef B2B_LOADMSG
+#undef B2B_G_VSX
+
+#else
+
 static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
     uint64_t m[16];
     uint64_t v[16];
@@ -221,6 +397,8 @@ static void blake2b_compress(blake2b_state *S, const uint8_t *block) {
 #undef ROUND
 }
 
+#endif
+
 int blake2b_update(blake2b_state *S, const void *in, size_t inlen) {
     const uint8_t *pin = (const uint8_t *)in;
 
@@ -330,12 +508,18 @@ fail:
 }
 
 /* Argon2 Team - Begin Code */
-int blake2b_long(void *pout, size_t outlen, const void *in, size_t inlen) {
-    uint8_t *out = (uint8_t *)pout;
+int blake2b_long_stream(argon2_output_fptr output, void *arg, size_t outlen,
+                        const void *in, size_t inlen, int *output_failed) {
     blake2b_state blake_state;
     uint8_t outlen_bytes[sizeof(uint32_t)] = {0};
+    uint8_t out_buffer[BLAKE2B_OUTBYTES];
+    uint8_t in_buffer[BLAKE2B_OUTBYTES];
     int ret = -1;
 
+    if (output_failed != NULL) {
+        *output_failed = 0;
+    }
+
     if (outlen > UINT32_MAX) {
         goto fail;
     }
@@ -351,40 +535,65 @@ int blake2b_long(void *pout, size_t outlen, const void *in, size_t inlen) {
         }                                                                      \
     } while ((void)0, 0)
 
+#define EMIT(buf, len)                                                         \
+    do {                                                                       \
+        ret = output(buf, len, arg);                                           \
+        if (ret != 0) {                                                        \
+            if (output_failed != NULL) {                                       \
+                *output_failed = 1;                                            \
+            }                                                                  \
+            goto fail;                                                         \
+        }                                                                      \
+    } while ((void)0, 0)
+
     if (outlen <= BLAKE2B_OUTBYTES) {
         TRY(blake2b_init(&blake_state, outlen));
         TRY(blake2b_update(&blake_state, outlen_bytes, sizeof(outlen_bytes)));
         TRY(blake2b_update(&blake_state, in, inlen));
-        TRY(blake2b_final(&blake_state, out, outlen));
+        TRY(blake2b_final(&blake_state, out_buffer, outlen));
+        EMIT(out_buffer, outlen);
     } else {
         uint32_t toproduce;
-        uint8_t out_buffer[BLAKE2B_OUTBYTES];
-        uint8_t in_buffer[BLAKE2B_OUTBYTES];
         TRY(blake2b_init(&blake_state, BLAKE2B_OUTBYTES));
         TRY(blake2b_update(&blake_state, outlen_bytes, sizeof(outlen_bytes)));
         TRY(blake2b_update(&blake_state, in, inlen));
         TRY(blake2b_final(&blake_state, out_buffer, BLAKE2B_OUTBYTES));
-        memcpy(out, out_buffer, BLAKE2B_OUTBYTES / 2);
-        out += BLAKE2B_OUTBYTES / 2;
+        EMIT(out_buffer, BLAKE2B_OUTBYTES / 2);
         toproduce = (uint32_t)outlen - BLAKE2B_OUTBYTES / 2;
 
         while (toproduce > BLAKE2B_OUTBYTES) {
             memcpy(in_buffer, out_buffer, BLAKE2B_OUTBYTES);
             TRY(blake2b(out_buffer, BLAKE2B_OUTBYTES, in_buffer,
                         BLAKE2B_OUTBYTES, NULL, 0));
-            memcpy(out, out_buffer, BLAKE2B_OUTBYTES / 2);
-            out += BLAKE2B_OUTBYTES / 2;
+            EMIT(out_buffer, BLAKE2B_OUTBYTES / 2);
             toproduce -= BLAKE2B_OUTBYTES / 2;
         }
 
         memcpy(in_buffer, out_buffer, BLAKE2B_OUTBYTES);
         TRY(blake2b(out_buffer, toproduce, in_buffer, BLAKE2B_OUTBYTES, NULL,
                     0));
-        memcpy(out, out_buffer, toproduce);
+        EMIT(out_buffer, toproduce);
     }
 fail:
     clear_internal_memory(&blake_state, sizeof(blake_state));
+    clear_internal_memory(out_buffer, sizeof(out_buffer));
+    clear_internal_memory(in_buffer, sizeof(in_buffer));
     return ret;
 #undef TRY
+#undef EMIT
+}
+
+static int blake2b_long_copy(const uint8_t *chunk, size_t chunklen,
+                             void *arg) {
+    uint8_t **out = (uint8_t **)arg;
+    memcpy(*out, chunk, chunklen);
+    *out += chunklen;
+    return 0;
+}
+
+int blake2b_long(void *pout, size_t outlen, const void *in, size_t inlen) {
+    uint8_t *out = (uint8_t *)pout;
+    return blake2b_long_stream(blake2b_long_copy, &out, outlen, in, inlen,
+                               NULL);
 }
 /* Argon2 Team - End Code */
@@ -0,0 +1,151 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef BLAKE_ROUND_MKA_NEON_H
+#define BLAKE_ROUND_MKA_NEON_H
+
+#include "blake2-impl.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+/*
+ * ARMv8 NEON port of the SSSE3 rounds in blamka-round-opt.h: one uint64x2_t
+ * per __m128i, vmull_u32 for _mm_mul_epu32, tbl for _mm_shuffle_epi8 and
+ * vext for _mm_alignr_epi8. Lanes are numbered as on x86 (little endian).
+ */
+
+static BLAKE2_INLINE uint64x2_t fBlaMka_neon(uint64x2_t x, uint64x2_t y) {
+    const uint64x2_t z = vmull_u32(vmovn_u64(x), vmovn_u64(y));
+    return vaddq_u64(vaddq_u64(x, y), vaddq_u64(z, z));
+}
+
+/* Byte shuffles rotating each 64-bit lane right by 24 and 16 bits */
+static const uint8_t NEON_ROT24[16] = {3,  4,  5,  6,  7,  0, 1, 2,
+                                       11, 12, 13, 14, 15, 8, 9, 10};
+static const uint8_t NEON_ROT16[16] = {2,  3,  4,  5,  6,  7,  0, 1,
+                                       10, 11, 12, 13, 14, 15, 8, 9};
+
+#define NEON_SHUFFLE_BYTES(x, table)                                           \
+    vreinterpretq_u64_u8(vqtbl1q_u8(vreinterpretq_u8_u64(x), vld1q_u8(table)))
+
+#define NEON_ROTI_EPI64(x, c)                                                  \
+    ((-(c) == 32)                                                              \
+         ? vreinterpretq_u64_u32(vrev64q_u32(vreinterpretq_u32_u64(x)))        \
+         : (-(c) == 24)                                                        \
+               ? NEON_SHUFFLE_BYTES(x, NEON_ROT24)                             \
+               : (-(c) == 16)                                                  \
+                     ? NEON_SHUFFLE_BYTES(x, NEON_ROT16)                       \
+                     : (-(c) == 63)                                            \
+                           ? vsriq_n_u64(vaddq_u64((x), (x)), (x), 63)         \
+                           : veorq_u64(vshrq_n_u64((x), -(c)),                 \
+                                       vshlq_n_u64((x), 64 - (-(c)))))
+
+#define G1_NEON(A0, B0, C0, D0, A1, B1, C1, D1)                                \
+    do {                                                                       \
+        A0 = fBlaMka_neon(A0, B0);                                             \
+        A1 = fBlaMka_neon(A1, B1);                                             \
+                                                                               \
+        D0 = veorq_u64(D0, A0);                                                \
+        D1 = veorq_u64(D1, A1);                                                \
+                                                                               \
+        D0 = NEON_ROTI_EPI64(D0, -32);                                         \
+        D1 = NEON_ROTI_EPI64(D1, -32);                                         \
+                                                                               \
+        C0 = fBlaMka_neon(C0, D0);                                             \
+        C1 = fBlaMka_neon(C1, D1);                                             \
+                                                                               \
+        B0 = veorq_u64(B0, C0);                                                \
+        B1 = veorq_u64(B1, C1);                                                \
+                                                                               \
+        B0 = NEON_ROTI_EPI64(B0, -24);                                         \
+        B1 = NEON_ROTI_EPI64(B1, -24);                                         \
+    } while ((void)0, 0)
+
+#define G2_NEON(A0, B0, C0, D0, A1, B1, C1, D1)                                \
+    do {                                                                       \
+        A0 = fBlaMka_neon(A0, B0);                                             \
+        A1 = fBlaMka_neon(A1, B1);                                             \
+                                                                               \
+        D0 = veorq_u64(D0, A0);                                                \
+        D1 = veorq_u64(D1, A1);                                                \
+                                                                               \
+        D0 = NEON_ROTI_EPI64(D0, -16);                                         \
+        D1 = NEON_ROTI_EPI64(D1, -16);                                         \
+                                                                               \
+        C0 = fBlaMka_neon(C0, D0);                                             \
+        C1 = fBlaMka_neon(C1, D1);                                             \
+                                                                               \
+        B0 = veorq_u64(B0, C0);                                                \
+        B1 = veorq_u64(B1, C1);                                                \
+                                                                               \
+        B0 = NEON_ROTI_EPI64(B0, -63);                                         \
+        B1 = NEON_ROTI_EPI64(B1, -63);                                         \
+    } while ((void)0, 0)
+
+/* vextq_u64(a, b, 1) is {a[1], b[0]}, i.e. _mm_alignr_epi8(b, a, 8) */
+#define DIAGONALIZE_NEON(A0, B0, C0, D0, A1, B1, C1, D1)                       \
+    do {                                                                       \
+        uint64x2_t t0 = vextq_u64(B0, B1, 1);                                  \
+        uint64x2_t t1 = vextq_u64(B1, B0, 1);                                  \
+        B0 = t0;                                                               \
+        B1 = t1;                                                               \
+                                                                               \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+                                                                               \
+        t0 = vextq_u64(D0, D1, 1);                                             \
+        t1 = vextq_u64(D1, D0, 1);                                             \
+        D0 = t1;                                                               \
+        D1 = t0;                                                               \
+    } while ((void)0, 0)
+
+#define UNDIAGONALIZE_NEON(A0, B0, C0, D0, A1, B1, C1, D1)                     \
+    do {                                                                       \
+        uint64x2_t t0 = vextq_u64(B1, B0, 1);                                  \
+        uint64x2_t t1 = vextq_u64(B0, B1, 1);                                  \
+        B0 = t0;                                                               \
+        B1 = t1;                                                               \
+                                                                               \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+                                                                               \
+        t0 = vextq_u64(D1, D0, 1);                                             \
+        t1 = vextq_u64(D0, D1, 1);                                             \
+        D0 = t1;                                                               \
+        D1 = t0;                                                               \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND_NEON(A0, A1, B0, B1, C0, C1, D0, D1)                      \
+    do {                                                                       \
+        G1_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+        G2_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+                                                                               \
+        DIAGONALIZE_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                      \
+                                                                               \
+        G1_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+        G2_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+                                                                               \
+        UNDIAGONALIZE_NEON(A0, B0, C0, D0, A1, B1, C1, D1);                    \
+    } while ((void)0, 0)
+
+#endif /* __ARM_NEON */
+
+#endif /* BLAKE_ROUND_MKA_NEON_H */
@@ -162,6 +162,14 @@ static BLAKE2_INLINE v2du fBlaMka_vsx(v2du x, v2du y) {
 #define VSX_LOADU(ptr) vec_xl(0, (const unsigned long long*)(ptr))
 #define VSX_STOREU(ptr, val) vec_xst((val), 0, (unsigned long long*)(ptr))
 
+/*
+ * Aligned Load/Store: lvx/stvx require 16-byte alignment but, unlike the
+ * lxvd2x/stxvd2x pair behind vec_xl/vec_xst, need no xxswapd fixup on
+ * little-endian POWER8.
+ */
+#define VSX_LOAD(ptr) ((v2du)vec_ld(0, (const v4su *)(ptr)))
+#define VSX_STORE(ptr, val) vec_st((v4su)(val), 0, (v4su *)(ptr))
+
 #endif /* __VSX__ || __ALTIVEC__ */
 
 #endif /* BLAKE_ROUND_MKA_VSX_H */
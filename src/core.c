@@ -19,6 +19,7 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <winbase.h> /* For SecureZeroMemory */
+#include <malloc.h>  /* For _aligned_malloc */
 #endif
 #if defined __STDC_LIB_EXT1__
 #define __STDC_WANT_LIB_EXT1__ 1
@@ -31,12 +32,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "core.h"
+#include "arena.h"
+#include "metrics.h"
 #include "thread.h"
 #include "blake2/blake2.h"
 #include "blake2/blake2-impl.h"
 
+/* Vector paths of index_alpha_block(); both store 64-bit block pointers.
+   The VSX one relies on vec_mule() picking the low words, which holds on
+   little-endian only; big-endian ppc64 takes the scalar loop. */
+#if defined(__AVX2__) && (defined(__x86_64__) || defined(_M_X64))
+#include <immintrin.h>
+#define INDEX_ALPHA_AVX2
+#elif defined(__VSX__) && defined(__powerpc64__) && defined(__LITTLE_ENDIAN__)
+#include <altivec.h>
+#define INDEX_ALPHA_VSX
+typedef __vector unsigned long long index_v2du;
+typedef __vector unsigned int index_v4su;
+#endif
+
 #ifdef GENKAT
 #include "genkat.h"
 #endif
@@ -86,9 +103,34 @@ static void store_block(void *output, const block *src) {
 
 /***************Memory functions*****************/
 
+static void *aligned_malloc(size_t size) {
+    size_t alignment = size >= ARGON2_HUGE_PAGE_SIZE ? ARGON2_HUGE_PAGE_SIZE
+                                                     : ARGON2_MEMORY_ALIGNMENT;
+#if defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    void *memory = NULL;
+    if (posix_memalign(&memory, alignment, size) != 0) {
+        return NULL;
+    }
+    return memory;
+#endif
+}
+
+static void aligned_free(void *memory) {
+#if defined(_WIN32)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
 int allocate_memory(const argon2_context *context, uint8_t **memory,
-                    size_t num, size_t size) {
+                    size_t num, size_t size, struct Argon2_arena **arena) {
     size_t memory_size = num*size;
+    if (arena != NULL) {
+        *arena = NULL;
+    }
     if (memory == NULL) {
         return ARGON2_MEMORY_ALLOCATION_ERROR;
     }
@@ -102,24 +144,33 @@ int allocate_memory(const argon2_context *context, uint8_t **memory,
     if (context->allocate_cbk) {
         (context->allocate_cbk)(memory, memory_size);
     } else {
-        *memory = malloc(memory_size);
+        *memory = arena == NULL ? NULL : arena_cache_get(memory_size, arena);
+        if (*memory == NULL) {
+            *memory = aligned_malloc(memory_size);
+        }
     }
 
     if (*memory == NULL) {
         return ARGON2_MEMORY_ALLOCATION_ERROR;
     }
 
+    metrics_memory(memory_size, 0);
     return ARGON2_OK;
 }
 
 void free_memory(const argon2_context *context, uint8_t *memory,
-                 size_t num, size_t size) {
+                 size_t num, size_t size, struct Argon2_arena *arena) {
     size_t memory_size = num*size;
     clear_internal_memory(memory, memory_size);
     if (context->free_cbk) {
         (context->free_cbk)(memory, memory_size);
+    } else if (arena != NULL) {
+        arena_cache_put(arena);
     } else {
-        free(memory);
+        aligned_free(memory);
+    }
+    if (memory != NULL) {
+        metrics_memory(0, memory_size);
     }
 }
 
@@ -152,28 +203,71 @@ void clear_internal_memory(void *v, size_t n) {
   }
 }
 
-void finalize(const argon2_context *context, argon2_instance_t *instance) {
-    if (context != NULL && instance != NULL) {
-        block blockhash;
-        uint32_t l;
+/* XOR the last block of each lane into @blockhash_bytes */
+static void final_block(uint8_t *blockhash_bytes,
+                        const argon2_instance_t *instance) {
+    block blockhash;
+    uint32_t l;
+
+    copy_block(&blockhash, instance->memory + instance->lane_length - 1);
+
+    /* XOR the last blocks */
+    for (l = 1; l < instance->lanes; ++l) {
+        uint32_t last_block_in_lane =
+            l * instance->lane_length + (instance->lane_length - 1);
+        xor_block(&blockhash, instance->memory + last_block_in_lane);
+    }
+
+    store_block(blockhash_bytes, &blockhash);
+    /* clear blockhash */
+    clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
+}
 
-        copy_block(&blockhash, instance->memory + instance->lane_length - 1);
+uint64_t monotonic_ns(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    if (!QueryPerformanceCounter(&counter) ||
+        !QueryPerformanceFrequency(&frequency)) {
+        return 0;
+    }
+    return (uint64_t)counter.QuadPart / (uint64_t)frequency.QuadPart *
+               UINT64_C(1000000000) +
+           (uint64_t)counter.QuadPart % (uint64_t)frequency.QuadPart *
+               UINT64_C(1000000000) / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}
 
-        /* XOR the last blocks */
-        for (l = 1; l < instance->lanes; ++l) {
-            uint32_t last_block_in_lane =
-                l * instance->lane_length + (instance->lane_length - 1);
-            xor_block(&blockhash, instance->memory + last_block_in_lane);
+void release_memory(const argon2_context *context,
+                    argon2_instance_t *instance) {
+    if (instance->caller_memory) {
+        if (!instance->defer_wipe) {
+            clear_internal_memory(instance->memory,
+                                  instance->memory_blocks * sizeof(block));
         }
+    } else {
+        free_memory(context, (uint8_t *)instance->memory,
+                    instance->memory_blocks, sizeof(block),
+                    instance->cache_arena);
+    }
+    ARGON2_PROBE(wipe_done, instance);
+}
 
+void finalize(const argon2_context *context, argon2_instance_t *instance) {
+    if (context != NULL && instance != NULL) {
+        ARGON2_PROBE(finalize, instance);
         /* Hash the result */
         {
             uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
-            store_block(blockhash_bytes, &blockhash);
+            final_block(blockhash_bytes, instance);
             blake2b_long(context->out, context->outlen, blockhash_bytes,
                          ARGON2_BLOCK_SIZE);
-            /* clear blockhash and blockhash_bytes */
-            clear_internal_memory(blockhash.v, ARGON2_BLOCK_SIZE);
+            /* clear blockhash_bytes */
             clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
         }
 
@@ -181,11 +275,35 @@ void finalize(const argon2_context *context, argon2_instance_t *instance) {
         print_tag(context->out, context->outlen);
 #endif
 
-        free_memory(context, (uint8_t *)instance->memory,
-                    instance->memory_blocks, sizeof(block));
+        release_memory(context, instance);
     }
 }
 
+int finalize_stream(const argon2_context *context, argon2_instance_t *instance,
+                    argon2_output_fptr output_cbk, void *arg) {
+    uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
+    int result, output_failed;
+
+    if (context == NULL || instance == NULL) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
+    ARGON2_PROBE(finalize, instance);
+    final_block(blockhash_bytes, instance);
+    release_memory(context, instance);
+
+    result = blake2b_long_stream(output_cbk, arg, context->outlen,
+                                 blockhash_bytes, ARGON2_BLOCK_SIZE,
+                                 &output_failed);
+    clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
+
+    if (result == 0) {
+        return ARGON2_OK;
+    }
+    return output_failed ? ARGON2_OUTPUT_CALLBACK_FAIL
+                         : ARGON2_INCORRECT_PARAMETER;
+}
+
 uint32_t index_alpha(const argon2_instance_t *instance,
                      const argon2_position_t *position, uint32_t pseudo_rand,
                      int same_lane) {
@@ -256,16 +374,541 @@ uint32_t index_alpha(const argon2_instance_t *instance,
     return absolute_position;
 }
 
+/*
+ * Reference locality tracing (ARGON2_TRACE_LOCALITY). Each segment counts
+ * into its own argon2_locality_trace, with bitmaps of the pages it has
+ * referenced, so lanes running in parallel do not share anything until
+ * run_segment() adds the segment to the totals.
+ */
+#define LOCALITY_PAGE_4K_SHIFT 2  /* 4 blocks per 4 KiB page */
+#define LOCALITY_PAGE_2M_SHIFT 11 /* 2048 blocks per 2 MiB page */
+
+#ifdef ARGON2_TRACE_LOCALITY
+static argon2_mutex_t locality_lock = ARGON2_MUTEX_INIT;
+static argon2_locality_stats
+    locality_stats[3][ARGON2_LOCALITY_PASSES][ARGON2_SYNC_POINTS];
+
+typedef struct Argon2_locality_trace {
+    argon2_locality_stats stats;
+    uint8_t *pages_4k; /* one bit per page of the whole memory */
+    uint8_t *pages_2m;
+} argon2_locality_trace;
+
+static void trace_page(uint8_t *pages, uint64_t page, uint64_t *distinct) {
+    const uint8_t bit = (uint8_t)(1 << (page & 7));
+    if (!(pages[page >> 3] & bit)) {
+        pages[page >> 3] |= bit;
+        ++*distinct;
+    }
+}
+
+static void trace_reference(const argon2_instance_t *instance,
+                            const argon2_position_t *position, uint32_t index,
+                            const block *ref_block) {
+    argon2_locality_trace *trace = position->trace;
+    const uint64_t curr_offset =
+        (uint64_t)position->lane * instance->lane_length +
+        (uint64_t)position->slice * instance->segment_length + index;
+    const uint64_t ref_offset = (uint64_t)(ref_block - instance->memory);
+    uint64_t distance = curr_offset > ref_offset ? curr_offset - ref_offset
+                                                 : ref_offset - curr_offset;
+    unsigned bucket = 0;
+
+    if (trace == NULL) {
+        return;
+    }
+    while (distance >>= 1) {
+        ++bucket;
+    }
+    trace->stats.refs++;
+    trace->stats.distance[bucket]++;
+    if (ref_offset / instance->lane_length != position->lane) {
+        trace->stats.cross_lane++;
+    }
+    trace_page(trace->pages_4k, ref_offset >> LOCALITY_PAGE_4K_SHIFT,
+               &trace->stats.pages_4k);
+    trace_page(trace->pages_2m, ref_offset >> LOCALITY_PAGE_2M_SHIFT,
+               &trace->stats.pages_2m);
+}
+
+static void trace_begin(const argon2_instance_t *instance,
+                        argon2_position_t *position,
+                        argon2_locality_trace *trace) {
+    memset(trace, 0, sizeof(*trace));
+    trace->pages_4k = (uint8_t *)calloc(
+        (instance->memory_blocks >> LOCALITY_PAGE_4K_SHIFT) / 8 + 1, 1);
+    trace->pages_2m = (uint8_t *)calloc(
+        (instance->memory_blocks >> LOCALITY_PAGE_2M_SHIFT) / 8 + 1, 1);
+    position->trace =
+        (trace->pages_4k != NULL && trace->pages_2m != NULL) ? trace : NULL;
+}
+
+static void trace_end(const argon2_instance_t *instance,
+                      const argon2_position_t *position,
+                      argon2_locality_trace *trace) {
+    const uint32_t pass = position->pass < ARGON2_LOCALITY_PASSES
+                              ? position->pass
+                              : ARGON2_LOCALITY_PASSES - 1;
+    argon2_locality_stats *total =
+        &locality_stats[instance->type][pass][position->slice];
+    unsigned k;
+
+    if (position->trace != NULL) {
+        argon2_mutex_lock(&locality_lock);
+        total->segments++;
+        total->refs += trace->stats.refs;
+        total->cross_lane += trace->stats.cross_lane;
+        for (k = 0; k < ARGON2_LOCALITY_BUCKETS; ++k) {
+            total->distance[k] += trace->stats.distance[k];
+        }
+        total->pages_4k += trace->stats.pages_4k;
+        total->pages_2m += trace->stats.pages_2m;
+        argon2_mutex_unlock(&locality_lock);
+    }
+    free(trace->pages_4k);
+    free(trace->pages_2m);
+}
+#endif
+
+int argon2_get_locality_stats(argon2_type type, uint32_t pass, uint32_t slice,
+                              argon2_locality_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef ARGON2_TRACE_LOCALITY
+    if ((unsigned)type > Argon2_id || slice >= ARGON2_SYNC_POINTS) {
+        return 0;
+    }
+    if (pass >= ARGON2_LOCALITY_PASSES) {
+        pass = ARGON2_LOCALITY_PASSES - 1;
+    }
+    argon2_mutex_lock(&locality_lock);
+    *stats = locality_stats[type][pass][slice];
+    argon2_mutex_unlock(&locality_lock);
+    return 1;
+#else
+    (void)type;
+    (void)pass;
+    (void)slice;
+    return 0;
+#endif
+}
+
+void argon2_reset_locality_stats(void) {
+#ifdef ARGON2_TRACE_LOCALITY
+    argon2_mutex_lock(&locality_lock);
+    memset(locality_stats, 0, sizeof(locality_stats));
+    argon2_mutex_unlock(&locality_lock);
+#endif
+}
+
+block *reference_block(const argon2_instance_t *instance,
+                       const argon2_position_t *position,
+                       uint64_t pseudo_rand) {
+    uint64_t ref_lane;
+    uint32_t ref_index;
+    block *ref_block;
+
+    /* 1.2.2 Computing the lane of the reference block */
+    ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
+
+    if ((position->pass == 0) && (position->slice == 0)) {
+        /* Can not reference other lanes yet */
+        ref_lane = position->lane;
+    }
+
+    /* 1.2.3 Computing the number of possible reference block within the
+     * lane.
+     */
+    ref_index = index_alpha(instance, position, pseudo_rand & 0xFFFFFFFF,
+                            ref_lane == position->lane);
+
+    ref_block = instance->memory + instance->lane_length * ref_lane + ref_index;
+#ifdef ARGON2_TRACE_LOCALITY
+    trace_reference(instance, position, position->index, ref_block);
+#endif
+    return ref_block;
+}
+
+void index_alpha_block(const argon2_instance_t *instance,
+                       const argon2_position_t *position,
+                       const block *address_block, uint32_t first,
+                       uint32_t count, block **ref_blocks) {
+    /* index_alpha() with the pass/slice branches hoisted out: the reference
+     * area is base_area plus (index - 1) in the own lane, or minus one for
+     * the first block of a segment in other lanes */
+    const uint32_t lane = position->lane;
+    const uint32_t lane_length = instance->lane_length;
+    const uint32_t base_area = (0 == position->pass)
+                                   ? position->slice * instance->segment_length
+                                   : lane_length - instance->segment_length;
+    const uint32_t start_position =
+        (0 == position->pass || position->slice == ARGON2_SYNC_POINTS - 1)
+            ? 0
+            : (position->slice + 1) * instance->segment_length;
+    const int own_lane_only = (0 == position->pass && 0 == position->slice) ||
+                              instance->lanes == 1;
+    uint64_t ref_lanes[ARGON2_ADDRESSES_IN_BLOCK];
+    uint32_t end = first + count;
+    uint32_t j = first;
+
+    /* The lane modulo has no vector form; do it up front */
+    if (!own_lane_only) {
+        for (j = first; j < end; ++j) {
+            ref_lanes[j] = (address_block->v[j] >> 32) % instance->lanes;
+        }
+        j = first;
+    }
+
+#if defined(INDEX_ALPHA_AVX2)
+    {
+        const __m256i lo32 = _mm256_set1_epi64x(0xFFFFFFFF);
+        const __m256i one = _mm256_set1_epi64x(1);
+        const __m256i lane_v = _mm256_set1_epi64x(lane);
+        const __m256i lane_length_v = _mm256_set1_epi64x(lane_length);
+        const __m256i base_area_v = _mm256_set1_epi64x(base_area);
+        const __m256i start_v = _mm256_set1_epi64x(start_position);
+        const __m256i memory_v =
+            _mm256_set1_epi64x((int64_t)(uintptr_t)instance->memory);
+        __m256i index_v = _mm256_add_epi64(
+            _mm256_set1_epi64x(position->index + first),
+            _mm256_set_epi64x(3, 2, 1, 0));
+
+        for (; j + 4 <= end; j += 4) {
+            __m256i rand_v = _mm256_loadu_si256(
+                (const __m256i *)(address_block->v + j));
+            __m256i ref_lane_v =
+                own_lane_only ? lane_v
+                              : _mm256_loadu_si256((const __m256i *)(ref_lanes + j));
+            __m256i same = _mm256_cmpeq_epi64(ref_lane_v, lane_v);
+            /* All ones is -1 once truncated to 32 bits */
+            __m256i first_block =
+                _mm256_cmpeq_epi64(index_v, _mm256_setzero_si256());
+            __m256i area = _mm256_and_si256(
+                _mm256_add_epi64(base_area_v,
+                                 _mm256_blendv_epi8(first_block,
+                                                    _mm256_sub_epi64(index_v, one),
+                                                    same)),
+                lo32);
+            __m256i rel = _mm256_srli_epi64(_mm256_mul_epu32(rand_v, rand_v), 32);
+            __m256i abs_v;
+
+            rel = _mm256_srli_epi64(_mm256_mul_epu32(area, rel), 32);
+            rel = _mm256_sub_epi64(_mm256_sub_epi64(area, one), rel);
+            abs_v = _mm256_add_epi64(start_v, rel);
+            abs_v = _mm256_sub_epi64(
+                abs_v, _mm256_andnot_si256(_mm256_cmpgt_epi64(lane_length_v, abs_v),
+                                           lane_length_v));
+            abs_v = _mm256_add_epi64(_mm256_mul_epu32(ref_lane_v, lane_length_v),
+                                     abs_v);
+            _mm256_storeu_si256((__m256i *)(ref_blocks + j),
+                                _mm256_add_epi64(memory_v,
+                                                 _mm256_slli_epi64(abs_v, 10)));
+            index_v = _mm256_add_epi64(index_v, _mm256_set1_epi64x(4));
+        }
+    }
+#elif defined(INDEX_ALPHA_VSX)
+    {
+        const index_v2du lo32 = {0xFFFFFFFFULL, 0xFFFFFFFFULL};
+        const index_v2du one = {1, 1};
+        const index_v2du two = {2, 2};
+        const index_v2du shift32 = {32, 32};
+        const index_v2du shift10 = {10, 10};
+        const index_v2du zero = {0, 0};
+        const index_v2du lane_v = {lane, lane};
+        const index_v2du lane_length_v = {lane_length, lane_length};
+        const index_v2du base_area_v = {base_area, base_area};
+        const index_v2du start_v = {start_position, start_position};
+        const index_v2du memory_v = {(uintptr_t)instance->memory,
+                                     (uintptr_t)instance->memory};
+        index_v2du index_v = {position->index + first,
+                              position->index + first + 1};
+
+        for (; j + 2 <= end; j += 2) {
+            index_v2du rand_v = vec_xl(0, (const unsigned long long *)
+                                              (address_block->v + j));
+            index_v2du ref_lane_v =
+                own_lane_only ? lane_v
+                              : vec_xl(0, (const unsigned long long *)
+                                              (ref_lanes + j));
+            index_v2du same = (index_v2du)vec_cmpeq(ref_lane_v, lane_v);
+            index_v2du first_block = (index_v2du)vec_cmpeq(index_v, zero);
+            index_v2du area = vec_and(
+                vec_add(base_area_v,
+                        vec_sel(first_block, vec_sub(index_v, one), same)),
+                lo32);
+            /* On little-endian vec_mule multiplies the low 32 bits of each
+               64-bit element */
+            index_v2du rel = vec_sr(
+                vec_mule((index_v4su)rand_v, (index_v4su)rand_v), shift32);
+            index_v2du abs_v;
+
+            rel = vec_sr(vec_mule((index_v4su)area, (index_v4su)rel), shift32);
+            rel = vec_sub(vec_sub(area, one), rel);
+            abs_v = vec_add(start_v, rel);
+            abs_v = vec_sub(abs_v,
+                            vec_andc(lane_length_v,
+                                     (index_v2du)vec_cmpgt(lane_length_v, abs_v)));
+            abs_v = vec_add(vec_mule((index_v4su)ref_lane_v,
+                                     (index_v4su)lane_length_v),
+                            abs_v);
+            vec_xst(vec_add(memory_v, vec_sl(abs_v, shift10)), 0,
+                    (unsigned long long *)(ref_blocks + j));
+            index_v = vec_add(index_v, two);
+        }
+    }
+#endif
+
+    /* Scalar tail, and everything without a vector path */
+    for (; j < end; ++j) {
+        const uint64_t pseudo_rand = address_block->v[j];
+        const uint32_t index = position->index + j;
+        const uint64_t ref_lane = own_lane_only ? lane : ref_lanes[j];
+        uint32_t reference_area_size;
+        uint64_t relative_position;
+        uint64_t absolute_position;
+
+        if (ref_lane == lane) {
+            reference_area_size = base_area + index - 1;
+        } else {
+            reference_area_size = base_area + ((index == 0) ? (-1) : 0);
+        }
+
+        relative_position = pseudo_rand & 0xFFFFFFFF;
+        relative_position = relative_position * relative_position >> 32;
+        relative_position = reference_area_size - 1 -
+                            (reference_area_size * relative_position >> 32);
+
+        absolute_position = start_position + relative_position;
+        if (absolute_position >= lane_length) {
+            absolute_position -= lane_length;
+        }
+        ref_blocks[j] =
+            instance->memory + lane_length * ref_lane + absolute_position;
+    }
+
+#ifdef ARGON2_TRACE_LOCALITY
+    for (j = first; j < end; ++j) {
+        trace_reference(instance, position, position->index + j,
+                        ref_blocks[j]);
+    }
+#endif
+}
+
+/*
+ * Makes the first and second block of @lane as G(H0||0||lane) and
+ * G(H0||1||lane)
+ */
+static void fill_lane_first_blocks(const uint8_t *prehash,
+                                   const argon2_instance_t *instance,
+                                   uint32_t lane) {
+    uint8_t blockhash[ARGON2_PREHASH_SEED_LENGTH];
+    uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
+
+    memcpy(blockhash, prehash, ARGON2_PREHASH_DIGEST_LENGTH);
+
+    store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 0);
+    store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH + 4, lane);
+    blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
+                 ARGON2_PREHASH_SEED_LENGTH);
+    load_block(&instance->memory[lane * instance->lane_length + 0],
+               blockhash_bytes);
+
+    store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 1);
+    blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
+                 ARGON2_PREHASH_SEED_LENGTH);
+    load_block(&instance->memory[lane * instance->lane_length + 1],
+               blockhash_bytes);
+
+    clear_internal_memory(blockhash, ARGON2_PREHASH_SEED_LENGTH);
+    clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
+}
+
+/*
+ * Segment scheduler shared by all hashes (argon2_executor_configure): at most
+ * executor_slots segments run at once. While an interactive hash fills its
+ * memory it holds a claim on as many slots as it has threads, and bulk
+ * segments only start in slots nobody claimed, so an interactive hash never
+ * queues behind more than the bulk segments already running. 0 slots turns
+ * the scheduler off.
+ */
+static argon2_mutex_t executor_lock = ARGON2_MUTEX_INIT;
+static argon2_cond_t executor_interactive_cond = ARGON2_COND_INIT;
+static argon2_cond_t executor_bulk_cond = ARGON2_COND_INIT;
+static uint32_t executor_slots = 0;
+static uint32_t executor_claimed = 0; /* by interactive hashes */
+static uint32_t executor_interactive = 0; /* interactive segments running */
+static uint32_t executor_bulk = 0;        /* bulk segments running */
+static uint32_t executor_active = 0; /* segments filling, with or without slots */
+static uint32_t executor_queued = 0; /* segments waiting for a slot */
+static uint32_t executor_thread_cap = 0; /* argon2_thread_cap_enable(), 0 off */
+static uint32_t executor_last_threads = 0; /* last executor_threads() */
+
+static int is_bulk(const argon2_instance_t *instance) {
+    const argon2_context *context = instance->context_ptr;
+    return context != NULL && (context->flags & ARGON2_FLAG_BULK);
+}
+
+static int executor_has_room(int bulk) {
+    if (bulk) {
+        uint32_t claimed = executor_claimed < executor_slots ? executor_claimed
+                                                             : executor_slots;
+        return executor_bulk + claimed < executor_slots;
+    }
+    return executor_interactive + executor_bulk < executor_slots;
+}
+
+int argon2_executor_configure(uint32_t slots) {
+#if defined(ARGON2_NO_THREADS)
+    (void)slots;
+#else
+    argon2_mutex_lock(&executor_lock);
+    executor_slots = slots;
+    argon2_cond_broadcast(&executor_interactive_cond);
+    argon2_cond_broadcast(&executor_bulk_cond);
+    argon2_mutex_unlock(&executor_lock);
+#endif
+    return ARGON2_OK;
+}
+
+uint32_t argon2_thread_cap_enable(int enable) {
+#if defined(ARGON2_NO_THREADS)
+    (void)enable;
+    return 0;
+#else
+    /* Count outside the lock: it reads files on Linux */
+    uint32_t cap = enable ? argon2_cpu_count() : 0;
+
+    argon2_mutex_lock(&executor_lock);
+    executor_thread_cap = cap;
+    argon2_mutex_unlock(&executor_lock);
+    return cap;
+#endif
+}
+
+uint32_t executor_threads(uint32_t threads) {
+    argon2_mutex_lock(&executor_lock);
+    if (executor_thread_cap != 0 && threads > executor_thread_cap) {
+        threads = executor_thread_cap;
+    }
+    executor_last_threads = threads;
+    argon2_mutex_unlock(&executor_lock);
+    return threads;
+}
+
+uint32_t executor_claim(const argon2_instance_t *instance) {
+    uint32_t claim = 0;
+
+    if (is_bulk(instance)) {
+        return 0;
+    }
+    argon2_mutex_lock(&executor_lock);
+    if (executor_slots != 0) {
+        claim = instance->threads;
+        executor_claimed += claim;
+    }
+    argon2_mutex_unlock(&executor_lock);
+    return claim;
+}
+
+void executor_unclaim(uint32_t claim) {
+    if (claim == 0) {
+        return;
+    }
+    argon2_mutex_lock(&executor_lock);
+    executor_claimed -= claim;
+    argon2_cond_broadcast(&executor_bulk_cond);
+    argon2_mutex_unlock(&executor_lock);
+}
+
+void run_segment(const argon2_instance_t *instance,
+                 argon2_position_t position) {
+    int bulk = is_bulk(instance);
+    argon2_cond_t *cond =
+        bulk ? &executor_bulk_cond : &executor_interactive_cond;
+    uint32_t *running = bulk ? &executor_bulk : &executor_interactive;
+    int entered = 0;
+
+    argon2_mutex_lock(&executor_lock);
+    if (executor_slots != 0) {
+        ++executor_queued;
+        while (executor_slots != 0 && !executor_has_room(bulk)) {
+            argon2_cond_wait(cond, &executor_lock);
+        }
+        --executor_queued;
+        ++*running;
+        entered = 1;
+    }
+    ++executor_active;
+    argon2_mutex_unlock(&executor_lock);
+
+#ifdef ARGON2_TRACE_LOCALITY
+    {
+        argon2_locality_trace trace;
+        trace_begin(instance, &position, &trace);
+        fill_segment(instance, position);
+        trace_end(instance, &position, &trace);
+    }
+#else
+    fill_segment(instance, position);
+#endif
+
+    argon2_mutex_lock(&executor_lock);
+    --executor_active;
+    if (entered) {
+        --*running;
+        /* Interactive waiters first; a bulk one only gets unclaimed room */
+        argon2_cond_broadcast(&executor_interactive_cond);
+        if (executor_has_room(1)) {
+            argon2_cond_broadcast(&executor_bulk_cond);
+        }
+    }
+    argon2_mutex_unlock(&executor_lock);
+}
+
+void executor_load(uint32_t *active, uint32_t *queued, uint32_t *thread_cap,
+                   uint32_t *last_threads) {
+    argon2_mutex_lock(&executor_lock);
+    *active = executor_active;
+    *queued = executor_queued;
+    *thread_cap = executor_thread_cap;
+    *last_threads = executor_last_threads;
+    argon2_mutex_unlock(&executor_lock);
+}
+
+int check_cancel(const argon2_instance_t *instance) {
+    const argon2_context *context = instance->context_ptr;
+
+    if (context == NULL || !(context->flags & ARGON2_FLAG_CANCEL)) {
+        return ARGON2_OK;
+    }
+    if (context->cancel != NULL && *context->cancel) {
+        return ARGON2_CANCELLED;
+    }
+    if (context->deadline_ns != 0 && monotonic_ns() >= context->deadline_ns) {
+        return ARGON2_DEADLINE_EXCEEDED;
+    }
+    return ARGON2_OK;
+}
+
 /* Single-threaded version for p=1 case */
 static int fill_memory_blocks_st(argon2_instance_t *instance) {
     uint32_t r, s, l;
+    int rc;
 
     for (r = 0; r < instance->passes; ++r) {
         for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
             for (l = 0; l < instance->lanes; ++l) {
-                argon2_position_t position = {r, l, (uint8_t)s, 0};
-                fill_segment(instance, position);
+                argon2_position_t position;
+                position.pass = r;
+                position.lane = l;
+                position.slice = (uint8_t)s;
+                position.index = 0;
+                rc = check_cancel(instance);
+                if (rc != ARGON2_OK) {
+                    return rc;
+                }
+                run_segment(instance, position);
             }
+            ARGON2_PROBE2(slice_done, instance, r, s);
         }
 #ifdef GENKAT
         internal_kat(instance, r); /* Print all memory blocks */
@@ -283,7 +926,14 @@ static void *fill_segment_thr(void *thread_data)
 #endif
 {
     argon2_thread_data *my_data = thread_data;
-    fill_segment(my_data->instance_ptr, my_data->pos);
+    /* Slice 0 of pass 0 only references its own lane, so each worker can
+       derive its lane's first blocks itself instead of the caller doing
+       all of them serially in initialize() */
+    if (my_data->pos.pass == 0 && my_data->pos.slice == 0) {
+        fill_lane_first_blocks(my_data->instance_ptr->prehash,
+                               my_data->instance_ptr, my_data->pos.lane);
+    }
+    run_segment(my_data->instance_ptr, my_data->pos);
     argon2_thread_exit();
     return 0;
 }
@@ -324,6 +974,17 @@ static int fill_memory_blocks_mt(argon2_instance_t *instance) {
                     }
                 }
 
+                /* Stop before the next segment, once the running ones
+                 * (l - threads + 1 up to l - 1) are done */
+                rc = check_cancel(instance);
+                if (rc != ARGON2_OK) {
+                    ll = l >= instance->threads ? l - instance->threads + 1 : 0;
+                    for (; ll < l; ++ll) {
+                        argon2_thread_join(thread[ll]);
+                    }
+                    goto fail;
+                }
+
                 /* 2.2 Create thread */
                 position.pass = r;
                 position.lane = l;
@@ -354,6 +1015,13 @@ static int fill_memory_blocks_mt(argon2_instance_t *instance) {
                     goto fail;
                 }
             }
+
+            /* All first blocks exist now, H0 is no longer needed */
+            if (r == 0 && s == 0) {
+                clear_internal_memory(instance->prehash,
+                                      sizeof(instance->prehash));
+            }
+            ARGON2_PROBE2(slice_done, instance, r, s);
         }
 
 #ifdef GENKAT
@@ -362,6 +1030,7 @@ static int fill_memory_blocks_mt(argon2_instance_t *instance) {
     }
 
 fail:
+    clear_internal_memory(instance->prehash, sizeof(instance->prehash));
     if (thread != NULL) {
         free(thread);
     }
@@ -374,15 +1043,21 @@ fail:
 #endif /* ARGON2_NO_THREADS */
 
 int fill_memory_blocks(argon2_instance_t *instance) {
+    uint32_t claim;
+    int rc;
+
 	if (instance == NULL || instance->lanes == 0) {
 	    return ARGON2_INCORRECT_PARAMETER;
     }
+    claim = executor_claim(instance);
 #if defined(ARGON2_NO_THREADS)
-    return fill_memory_blocks_st(instance);
+    rc = fill_memory_blocks_st(instance);
 #else
-    return instance->threads == 1 ?
+    rc = instance->threads == 1 ?
 			fill_memory_blocks_st(instance) : fill_memory_blocks_mt(instance);
 #endif
+    executor_unclaim(claim);
+    return rc;
 }
 
 int validate_inputs(const argon2_context *context) {
@@ -394,6 +1069,14 @@ int validate_inputs(const argon2_context *context) {
         return ARGON2_OUTPUT_PTR_NULL;
     }
 
+    return validate_parameters(context);
+}
+
+int validate_parameters(const argon2_context *context) {
+    if (NULL == context) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
     /* Validate output length */
     if (ARGON2_MIN_OUTLEN > context->outlen) {
         return ARGON2_OUTPUT_TOO_SHORT;
@@ -514,25 +1197,9 @@ int validate_inputs(const argon2_context *context) {
 
 void fill_first_blocks(uint8_t *blockhash, const argon2_instance_t *instance) {
     uint32_t l;
-    /* Make the first and second block in each lane as G(H0||0||i) or
-       G(H0||1||i) */
-    uint8_t blockhash_bytes[ARGON2_BLOCK_SIZE];
     for (l = 0; l < instance->lanes; ++l) {
-
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 0);
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH + 4, l);
-        blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
-                     ARGON2_PREHASH_SEED_LENGTH);
-        load_block(&instance->memory[l * instance->lane_length + 0],
-                   blockhash_bytes);
-
-        store32(blockhash + ARGON2_PREHASH_DIGEST_LENGTH, 1);
-        blake2b_long(blockhash_bytes, ARGON2_BLOCK_SIZE, blockhash,
-                     ARGON2_PREHASH_SEED_LENGTH);
-        load_block(&instance->memory[l * instance->lane_length + 1],
-                   blockhash_bytes);
+        fill_lane_first_blocks(blockhash, instance, l);
     }
-    clear_internal_memory(blockhash_bytes, ARGON2_BLOCK_SIZE);
 }
 
 void initial_hash(uint8_t *blockhash, argon2_context *context,
@@ -617,12 +1284,17 @@ int initialize(argon2_instance_t *instance, argon2_context *context) {
         return ARGON2_INCORRECT_PARAMETER;
     instance->context_ptr = context;
 
-    /* 1. Memory allocation */
-    result = allocate_memory(context, (uint8_t **)&(instance->memory),
-                             instance->memory_blocks, sizeof(block));
-    if (result != ARGON2_OK) {
-        return result;
+    /* 1. Memory allocation, unless the caller provided the blocks */
+    if (!instance->caller_memory) {
+        result = allocate_memory(context, (uint8_t **)&(instance->memory),
+                                 instance->memory_blocks, sizeof(block),
+                                 instance->stepped ? NULL
+                                                   : &instance->cache_arena);
+        if (result != ARGON2_OK) {
+            return result;
+        }
     }
+    ARGON2_PROBE(alloc_done, instance);
 
     /* 2. Initial hashing */
     /* H_0 + 8 extra bytes to produce the first blocks */
@@ -638,9 +1310,19 @@ int initialize(argon2_instance_t *instance, argon2_context *context) {
     initial_kat(blockhash, context, instance->type);
 #endif
 
-    /* 3. Creating first blocks, we always have at least two blocks in a slice
+    /* 3. Creating first blocks, we always have at least two blocks in a slice.
+     * With several threads every lane worker creates its own first blocks
+     * at the start of pass 0 (see fill_segment_thr).
      */
+#if defined(ARGON2_NO_THREADS)
     fill_first_blocks(blockhash, instance);
+#else
+    if (instance->threads == 1) {
+        fill_first_blocks(blockhash, instance);
+    } else {
+        memcpy(instance->prehash, blockhash, ARGON2_PREHASH_DIGEST_LENGTH);
+    }
+#endif
     /* Clearing the hash */
     clear_internal_memory(blockhash, ARGON2_PREHASH_SEED_LENGTH);
 
@@ -19,6 +19,7 @@
 #define ARGON2_CORE_H
 
 #include "argon2.h"
+#include "probes.h"
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
@@ -42,6 +43,21 @@ enum argon2_core_constants {
     ARGON2_PREHASH_SEED_LENGTH = 72
 };
 
+/*
+ * Alignment the internal allocator guarantees for the block arena: the larger
+ * of the cache line size (128 bytes on POWER, 64 bytes elsewhere) and the
+ * widest SIMD register in use (64 bytes for AVX-512). Arenas of at least
+ * ARGON2_HUGE_PAGE_SIZE bytes are aligned to that boundary instead, so that
+ * transparent huge pages can back them from the first byte.
+ */
+#if defined(__powerpc64__) || defined(__powerpc__) || defined(__PPC64__)
+#define ARGON2_CACHE_LINE_SIZE 128
+#else
+#define ARGON2_CACHE_LINE_SIZE 64
+#endif
+#define ARGON2_MEMORY_ALIGNMENT ARGON2_CACHE_LINE_SIZE
+#define ARGON2_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 /*************************Argon2 internal data types***********************/
 
 /*
@@ -62,6 +78,8 @@ void copy_block(block *dst, const block *src);
 /* XOR @src onto @dst bytewise */
 void xor_block(block *dst, const block *src);
 
+struct Argon2_arena; /* see arena.h */
+
 /*
  * Argon2 instance: memory pointer, number of passes, amount of memory, type,
  * and derived values.
@@ -80,6 +98,13 @@ typedef struct Argon2_instance_t {
     argon2_type type;
     int print_internals; /* whether to print the memory blocks */
     argon2_context *context_ptr; /* points back to original context */
+    int caller_memory; /* memory belongs to the caller: wiped, never freed */
+    int defer_wipe;    /* caller memory is wiped later by its session */
+    /* H0, kept until the lane workers have filled their first blocks */
+    uint8_t prehash[ARGON2_PREHASH_DIGEST_LENGTH];
+    uint64_t start_ns; /* monotonic_ns() at argon2_setup() */
+    struct Argon2_arena *cache_arena; /* thread arena holding the blocks */
+    int stepped; /* argon2_begin(): blocks may outlive the calling thread */
 } argon2_instance_t;
 
 /*
@@ -91,8 +116,50 @@ typedef struct Argon2_position_t {
     uint32_t lane;
     uint8_t slice;
     uint32_t index;
+#ifdef ARGON2_TRACE_LOCALITY
+    /* Where reference_block() and index_alpha_block() account the blocks
+       they pick; set by run_segment(), NULL if it could not allocate it */
+    struct Argon2_locality_trace *trace;
+#endif
 } argon2_position_t;
 
+/*
+ * Reference block of the next block in a data-dependent segment. The kernels'
+ * fill_block() resolves it as soon as the first word of the current block is
+ * final, and prefetches it while the rest of the block is being stored.
+ */
+typedef struct Argon2_next_ref {
+    const argon2_instance_t *instance;
+    argon2_position_t position; /* position of the next block */
+    block *ref_block;
+} argon2_next_ref_t;
+
+/* Hints the cache to load the 1 KiB block at @p, where supported */
+#if defined(__GNUC__)
+#define ARGON2_PREFETCH_BLOCK(p)                                               \
+    do {                                                                       \
+        const char *prefetch_p_ = (const char *)(p);                           \
+        unsigned prefetch_i_;                                                  \
+        for (prefetch_i_ = 0; prefetch_i_ < ARGON2_BLOCK_SIZE;                 \
+             prefetch_i_ += 64) {                                              \
+            __builtin_prefetch(prefetch_p_ + prefetch_i_, 0, 3);               \
+        }                                                                      \
+    } while ((void)0, 0)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define ARGON2_PREFETCH_BLOCK(p)                                               \
+    do {                                                                       \
+        const char *prefetch_p_ = (const char *)(p);                           \
+        unsigned prefetch_i_;                                                  \
+        for (prefetch_i_ = 0; prefetch_i_ < ARGON2_BLOCK_SIZE;                 \
+             prefetch_i_ += 64) {                                              \
+            _mm_prefetch(prefetch_p_ + prefetch_i_, _MM_HINT_T0);              \
+        }                                                                      \
+    } while ((void)0, 0)
+#else
+#define ARGON2_PREFETCH_BLOCK(p) ((void)(p))
+#endif
+
 /*Struct that holds the inputs for thread handling FillSegment*/
 typedef struct Argon2_thread_data {
     argon2_instance_t *instance_ptr;
@@ -102,15 +169,21 @@ typedef struct Argon2_thread_data {
 /*************************Argon2 core functions********************************/
 
 /* Allocates memory to the given pointer, uses the appropriate allocator as
- * specified in the context. Total allocated memory is num*size.
+ * specified in the context. Total allocated memory is num*size. The internal
+ * allocator serves the request from the calling thread's cached arena when
+ * argon2_thread_cache_enable() is on, and otherwise aligns the memory to
+ * ARGON2_MEMORY_ALIGNMENT (or to ARGON2_HUGE_PAGE_SIZE for large requests);
+ * memory returned by a custom allocate_cbk carries no alignment guarantee.
  * @param context argon2_context which specifies the allocator
  * @param memory pointer to the pointer to the memory
  * @param size the size in bytes for each element to be allocated
  * @param num the number of elements to be allocated
+ * @param arena receives the thread arena the memory came from, NULL if none;
+ * pass NULL to keep the memory out of the thread cache
  * @return ARGON2_OK if @memory is a valid pointer and memory is allocated
  */
 int allocate_memory(const argon2_context *context, uint8_t **memory,
-                    size_t num, size_t size);
+                    size_t num, size_t size, struct Argon2_arena **arena);
 
 /*
  * Frees memory at the given pointer, uses the appropriate deallocator as
@@ -119,9 +192,10 @@ int allocate_memory(const argon2_context *context, uint8_t **memory,
  * @param memory pointer to buffer to be freed
  * @param size the size in bytes for each element to be deallocated
  * @param num the number of elements to be deallocated
+ * @param arena the thread arena allocate_memory() took it from, or NULL
  */
 void free_memory(const argon2_context *context, uint8_t *memory,
-                 size_t num, size_t size);
+                 size_t num, size_t size, struct Argon2_arena *arena);
 
 /* Function that securely cleans the memory. This ignores any flags set
  * regarding clearing memory. Usually one just calls clear_internal_memory.
@@ -137,6 +211,10 @@ void secure_wipe_memory(void *v, size_t n);
  */
 void clear_internal_memory(void *v, size_t n);
 
+/* Returns a monotonic timestamp in nanoseconds, or 0 if no clock is available
+ */
+uint64_t monotonic_ns(void);
+
 /*
  * Computes absolute position of reference block in the lane following a skewed
  * distribution and using a pseudo-random value as input
@@ -151,6 +229,36 @@ uint32_t index_alpha(const argon2_instance_t *instance,
                      const argon2_position_t *position, uint32_t pseudo_rand,
                      int same_lane);
 
+/*
+ * Picks the reference lane from the upper half of @pseudo_rand and the block
+ * within it through index_alpha()
+ * @param instance Pointer to the current instance
+ * @param position Position of the block being constructed
+ * @param pseudo_rand 64-bit pseudo-random value of that block
+ * @return Pointer to the reference block
+ * @pre All pointers must be valid
+ */
+block *reference_block(const argon2_instance_t *instance,
+                       const argon2_position_t *position,
+                       uint64_t pseudo_rand);
+
+/*
+ * reference_block() for a run of entries of one address block, vectorized
+ * where the target allows it
+ * @param instance Pointer to the current instance
+ * @param position Position of the block that takes @address_block->v[0]
+ * @param address_block Pseudo-random values of a data-independent segment
+ * @param first Index of the first entry to map
+ * @param count Number of entries to map; @first + @count must not exceed
+ * ARGON2_ADDRESSES_IN_BLOCK
+ * @param ref_blocks Receives the reference block of entry j at index j
+ * @pre All pointers must be valid
+ */
+void index_alpha_block(const argon2_instance_t *instance,
+                       const argon2_position_t *position,
+                       const block *address_block, uint32_t first,
+                       uint32_t count, block **ref_blocks);
+
 /*
  * Function that validates all inputs against predefined restrictions and return
  * an error code
@@ -160,6 +268,14 @@ uint32_t index_alpha(const argon2_instance_t *instance,
  */
 int validate_inputs(const argon2_context *context);
 
+/*
+ * Same as validate_inputs, except that @context->out may be NULL (for tags
+ * that are streamed to a callback instead of written to @context->out)
+ * @param context Pointer to current Argon2 context
+ * @return ARGON2_OK if everything is all right, otherwise one of error codes
+ */
+int validate_parameters(const argon2_context *context);
+
 /*
  * Hashes all the inputs into @a blockhash[PREHASH_DIGEST_LENGTH], clears
  * password and secret if needed
@@ -206,6 +322,71 @@ int initialize(argon2_instance_t *instance, argon2_context *context);
  */
 void finalize(const argon2_context *context, argon2_instance_t *instance);
 
+/*
+ * Wipes the memory blocks of @instance (unless its session defers that) and
+ * frees them unless the caller owns them
+ * @param context Context whose free_cbk released the memory, if any
+ * @param instance Pointer to current instance of Argon2
+ */
+void release_memory(const argon2_context *context,
+                    argon2_instance_t *instance);
+
+/*
+ * Same as finalize, but hands the tag to @output_cbk chunk by chunk instead of
+ * writing it to context->out. Deallocates the memory in all cases.
+ * @param context Pointer to current Argon2 context
+ * @param instance Pointer to current instance of Argon2
+ * @param output_cbk Callback receiving the tag
+ * @param arg Opaque pointer passed to @output_cbk
+ * @return ARGON2_OK if successful, ARGON2_OUTPUT_CALLBACK_FAIL if the callback
+ * aborted, ARGON2_INCORRECT_PARAMETER if BLAKE2b rejected the tag length
+ */
+int finalize_stream(const argon2_context *context, argon2_instance_t *instance,
+                    argon2_output_fptr output_cbk, void *arg);
+
+/*
+ * fill_segment() under the segment scheduler of argon2_executor_configure(),
+ * which may make it wait for a free slot first
+ * @param instance Pointer to the current instance
+ * @param position Current position
+ */
+void run_segment(const argon2_instance_t *instance,
+                 argon2_position_t position);
+
+/*
+ * Claims scheduler slots for the threads of an interactive hash that is
+ * about to fill its memory, so that bulk segments leave them free
+ * @return The claim to hand to executor_unclaim() (0 for bulk hashes or
+ * with the scheduler off)
+ */
+uint32_t executor_claim(const argon2_instance_t *instance);
+
+/* Gives back the slots of executor_claim() */
+void executor_unclaim(uint32_t claim);
+
+/*
+ * Reports the segments being filled right now and those waiting for a
+ * scheduler slot, across all hashes of the process, the thread cap of
+ * argon2_thread_cap_enable() (0 if none) and the threads of the most recently
+ * started hash
+ */
+void executor_load(uint32_t *active, uint32_t *queued, uint32_t *thread_cap,
+                   uint32_t *last_threads);
+
+/*
+ * Applies the cap of argon2_thread_cap_enable() to a hash's @threads, and
+ * records the result as the threads of the most recently started hash
+ * @return The threads the hash may use
+ */
+uint32_t executor_threads(uint32_t threads);
+
+/*
+ * Checks the cancellation token and deadline of the instance's context, if
+ * ARGON2_FLAG_CANCEL enables them
+ * @return ARGON2_OK to go on, ARGON2_CANCELLED or ARGON2_DEADLINE_EXCEEDED
+ */
+int check_cancel(const argon2_instance_t *instance);
+
 /*
  * Function that fills the segment using previous segments also from other
  * threads
@@ -221,7 +402,8 @@ void fill_segment(const argon2_instance_t *instance,
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
  * @param instance Pointer to the current instance
- * @return ARGON2_OK if successful, @context->state
+ * @return ARGON2_OK if successful, @context->state; ARGON2_CANCELLED or
+ * ARGON2_DEADLINE_EXCEEDED if check_cancel() stopped it
  */
 int fill_memory_blocks(argon2_instance_t *instance);
 
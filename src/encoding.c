@@ -199,6 +199,201 @@ static const char *from_base64(void *dst, size_t *dst_len, const char *src) {
     return src;
 }
 
+/*
+ * Variable-time Base64, for fields that are not secret (salts, and tags
+ * when ARGON2_FLAG_FAST_ENCODING is set). Same alphabet, output and error
+ * behaviour as to_base64()/from_base64() above, but driven by lookup
+ * tables, and by SSSE3 for runs of 12 bytes / 16 characters.
+ */
+static const char b64_enc_table[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const unsigned char b64_dec_table[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+#if defined(__SSSE3__)
+
+#include <tmmintrin.h>
+
+/* 12 bytes at 'src' (16 are read) to 16 Base64 characters at 'dst' */
+static void b64_encode_block(char *dst, const unsigned char *src) {
+    __m128i in, t0, t1, t2, t3, off;
+
+    in = _mm_loadu_si128((const __m128i *)src);
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5,
+                                           3, 4, 1, 2, 0, 1));
+    /* Spread each 3-byte group over four bytes holding 6 bits each */
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);
+
+    /* Map 0..63 to ASCII: 'A' + x, then shifts for a-z, 0-9, '+' and '/' */
+    off = _mm_set1_epi8(65);
+    off = _mm_add_epi8(off, _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(25)),
+                                          _mm_set1_epi8(6)));
+    off = _mm_add_epi8(off, _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(51)),
+                                          _mm_set1_epi8(-75)));
+    off = _mm_add_epi8(off, _mm_and_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(62)),
+                                          _mm_set1_epi8(-15)));
+    off = _mm_add_epi8(off, _mm_and_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(63)),
+                                          _mm_set1_epi8(-12)));
+    _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(in, off));
+}
+
+/* 16 valid Base64 characters at 'src' to 12 bytes at 'dst' */
+static void b64_decode_block(unsigned char *dst, const char *src) {
+    __m128i in, sel, val;
+    unsigned char tmp[16];
+
+    in = _mm_loadu_si128((const __m128i *)src);
+
+    /* The run was validated by the caller, so only the range matters */
+    val = in;
+    sel = _mm_cmpgt_epi8(in, _mm_set1_epi8('@'));
+    val = _mm_add_epi8(val, _mm_and_si128(sel, _mm_set1_epi8(-65)));
+    sel = _mm_cmpgt_epi8(in, _mm_set1_epi8('`'));
+    val = _mm_add_epi8(val, _mm_and_si128(sel, _mm_set1_epi8(-6)));
+    sel = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('/')),
+                        _mm_cmplt_epi8(in, _mm_set1_epi8(':')));
+    val = _mm_add_epi8(val, _mm_and_si128(sel, _mm_set1_epi8(4)));
+    sel = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+    val = _mm_add_epi8(val, _mm_and_si128(sel, _mm_set1_epi8(19)));
+    sel = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    val = _mm_add_epi8(val, _mm_and_si128(sel, _mm_set1_epi8(16)));
+
+    /* Pack four 6-bit values into three bytes */
+    val = _mm_maddubs_epi16(val, _mm_set1_epi32(0x01400140));
+    val = _mm_madd_epi16(val, _mm_set1_epi32(0x00011000));
+    val = _mm_shuffle_epi8(val, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                              13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *)tmp, val);
+    memcpy(dst, tmp, 12);
+}
+
+#endif
+
+static size_t to_base64_fast(char *dst, size_t dst_len, const void *src,
+                             size_t src_len) {
+    size_t olen;
+    const unsigned char *buf;
+    unsigned acc, acc_len;
+
+    olen = b64len((uint32_t)src_len);
+    if (src_len > UINT32_MAX || dst_len <= olen) {
+        return (size_t)-1;
+    }
+    buf = (const unsigned char *)src;
+#if defined(__SSSE3__)
+    while (src_len >= 16) {
+        b64_encode_block(dst, buf);
+        dst += 16;
+        buf += 12;
+        src_len -= 12;
+    }
+#endif
+    while (src_len >= 3) {
+        acc = ((unsigned)buf[0] << 16) | ((unsigned)buf[1] << 8) | buf[2];
+        dst[0] = b64_enc_table[acc >> 18];
+        dst[1] = b64_enc_table[(acc >> 12) & 0x3F];
+        dst[2] = b64_enc_table[(acc >> 6) & 0x3F];
+        dst[3] = b64_enc_table[acc & 0x3F];
+        dst += 4;
+        buf += 3;
+        src_len -= 3;
+    }
+    acc = 0;
+    acc_len = 0;
+    while (src_len-- > 0) {
+        acc = (acc << 8) + (*buf++);
+        acc_len += 8;
+    }
+    while (acc_len >= 6) {
+        acc_len -= 6;
+        *dst++ = b64_enc_table[(acc >> acc_len) & 0x3F];
+    }
+    if (acc_len > 0) {
+        *dst++ = b64_enc_table[(acc << (6 - acc_len)) & 0x3F];
+    }
+    *dst++ = 0;
+    return olen;
+}
+
+static const char *from_base64_fast(void *dst, size_t *dst_len,
+                                    const char *src) {
+    size_t n, len;
+    unsigned char *buf;
+    unsigned acc, acc_len, d;
+
+    /* Measure the run first so that no block read crosses its end */
+    for (n = 0; b64_dec_table[(unsigned char)src[n]] != 0xFF; n++) {
+    }
+    if (n % 4 == 1 || (n / 4) * 3 + (n % 4 ? n % 4 - 1 : 0) > *dst_len) {
+        return NULL;
+    }
+
+    buf = (unsigned char *)dst;
+    len = 0;
+#if defined(__SSSE3__)
+    while (n >= 16) {
+        b64_decode_block(buf, src);
+        buf += 12;
+        len += 12;
+        src += 16;
+        n -= 16;
+    }
+#endif
+    while (n >= 4) {
+        acc = ((unsigned)b64_dec_table[(unsigned char)src[0]] << 18) |
+              ((unsigned)b64_dec_table[(unsigned char)src[1]] << 12) |
+              ((unsigned)b64_dec_table[(unsigned char)src[2]] << 6) |
+              (unsigned)b64_dec_table[(unsigned char)src[3]];
+        buf[0] = (unsigned char)(acc >> 16);
+        buf[1] = (unsigned char)(acc >> 8);
+        buf[2] = (unsigned char)acc;
+        buf += 3;
+        len += 3;
+        src += 4;
+        n -= 4;
+    }
+    acc = 0;
+    acc_len = 0;
+    while (n-- > 0) {
+        d = b64_dec_table[(unsigned char)*src++];
+        acc = (acc << 6) + d;
+        acc_len += 6;
+        if (acc_len >= 8) {
+            acc_len -= 8;
+            *buf++ = (acc >> acc_len) & 0xFF;
+            len++;
+        }
+    }
+
+    /* Same trailing-bit rule as from_base64() */
+    if ((acc & (((unsigned)1 << acc_len) - 1)) != 0) {
+        return NULL;
+    }
+    *dst_len = len;
+    return src;
+}
+
 /*
  * Decode decimal integer from 'str'; the value is written in '*v'.
  * Returned value is a pointer to the next non-decimal character in the
@@ -302,10 +497,10 @@ int decode_string(argon2_context *ctx, const char *str, argon2_type type) {
 
 
 /* Decoding base64 into a binary buffer */
-#define BIN(buf, max_len, len)                                                 \
+#define BIN(decoder, buf, max_len, len)                                        \
     do {                                                                       \
         size_t bin_len = (max_len);                                            \
-        str = from_base64(buf, &bin_len, str);                                 \
+        str = decoder(buf, &bin_len, str);                                     \
         if (str == NULL || bin_len > UINT32_MAX) {                             \
             return ARGON2_DECODING_FAIL;                                       \
         }                                                                      \
@@ -314,6 +509,7 @@ int decode_string(argon2_context *ctx, const char *str, argon2_type type) {
 
     size_t maxsaltlen = ctx->saltlen;
     size_t maxoutlen = ctx->outlen;
+    int fast_tag = (ctx->flags & ARGON2_FLAG_FAST_ENCODING) != 0;
     int validation_result;
     const char* type_string;
 
@@ -339,9 +535,13 @@ int decode_string(argon2_context *ctx, const char *str, argon2_type type) {
     ctx->threads = ctx->lanes;
 
     CC("$");
-    BIN(ctx->salt, maxsaltlen, ctx->saltlen);
+    BIN(from_base64_fast, ctx->salt, maxsaltlen, ctx->saltlen);
     CC("$");
-    BIN(ctx->out, maxoutlen, ctx->outlen);
+    if (fast_tag) {
+        BIN(from_base64_fast, ctx->out, maxoutlen, ctx->outlen);
+    } else {
+        BIN(from_base64, ctx->out, maxoutlen, ctx->outlen);
+    }
 
     /* The rest of the fields get the default values */
     ctx->secret = NULL;
@@ -390,9 +590,9 @@ int encode_string(char *dst, size_t dst_len, argon2_context *ctx,
         SS(tmp);                                                               \
     } while ((void)0, 0)
 
-#define SB(buf, len)                                                           \
+#define SB(encoder, buf, len)                                                  \
     do {                                                                       \
-        size_t sb_len = to_base64(dst, dst_len, buf, len);                     \
+        size_t sb_len = encoder(dst, dst_len, buf, len);                       \
         if (sb_len == (size_t)-1) {                                            \
             return ARGON2_ENCODING_FAIL;                                       \
         }                                                                      \
@@ -426,10 +626,14 @@ int encode_string(char *dst, size_t dst_len, argon2_context *ctx,
     SX(ctx->lanes);
 
     SS("$");
-    SB(ctx->salt, ctx->saltlen);
+    SB(to_base64_fast, ctx->salt, ctx->saltlen);
 
     SS("$");
-    SB(ctx->out, ctx->outlen);
+    if (ctx->flags & ARGON2_FLAG_FAST_ENCODING) {
+        SB(to_base64_fast, ctx->out, ctx->outlen);
+    } else {
+        SB(to_base64, ctx->out, ctx->outlen);
+    }
     return ARGON2_OK;
 
 #undef SS
@@ -40,6 +40,8 @@ int encode_string(char *dst, size_t dst_len, argon2_context *ctx,
 * ctx.outlen (which must be the maximal salt and out length values that are
 * allowed), ctx.salt and ctx.out (which must be buffers of the specified
 * length), and ctx.pwd and ctx.pwdlen which must hold a valid password.
+* ctx.flags selects the Base64 codec for the tag (ARGON2_FLAG_FAST_ENCODING)
+* and is reset to ARGON2_DEFAULT_FLAGS on return.
 *
 * Invalid input string causes an error. On success, the ctx is valid and all
 * fields have been initialized.
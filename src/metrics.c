@@ -0,0 +1,579 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "core.h"
+#include "metrics.h"
+#include "thread.h"
+
+/*
+ * Counts of one thread. Only its owner updates them, so its lock is only
+ * ever contended by a snapshot.
+ */
+typedef struct Argon2_metrics_shard {
+    argon2_mutex_t lock;
+    argon2_metrics counts; /* allocated_bytes may wrap: see metrics_add() */
+    struct Argon2_metrics_shard *prev, *next; /* registry links */
+} argon2_metrics_shard;
+
+/* Live shards, guarded by shards_lock, which is taken before any shard's
+   lock. retired keeps the counts of threads that have exited or could not
+   get a shard of their own, guarded by retired_lock. */
+static argon2_mutex_t shards_lock = ARGON2_MUTEX_INIT;
+static argon2_metrics_shard *shards = NULL;
+static argon2_mutex_t retired_lock = ARGON2_MUTEX_INIT;
+static argon2_metrics retired;
+
+/***************Counts*****************/
+
+/* Latency bucket of @ns, ARGON2_METRICS_BUCKETS if it is beyond the last */
+static uint32_t bucket_of(uint64_t ns) {
+    uint32_t octave = 0;
+
+    if (ns <= (UINT64_C(1) << 16)) {
+        return 0;
+    }
+    /* Bounds are inclusive: 2^16 < ns <= 2^17 is octave 0 */
+    ns -= 1;
+    while ((ns >> (octave + 17)) != 0) {
+        ++octave;
+    }
+    if (octave >= ARGON2_METRICS_BUCKETS / 4) {
+        return ARGON2_METRICS_BUCKETS;
+    }
+    return octave * 4 + (uint32_t)((ns >> (octave + 14)) & 3);
+}
+
+/* Histogram of a parameter set, added to @metrics if it is new and fits */
+static argon2_metrics_histogram *histogram_of(argon2_metrics *metrics,
+                                              argon2_type type,
+                                              uint32_t m_cost, uint32_t t_cost,
+                                              uint32_t lanes) {
+    argon2_metrics_histogram *h;
+    uint32_t i;
+
+    for (i = 0; i < metrics->histograms; ++i) {
+        h = &metrics->histogram[i];
+        if (h->type == type && h->m_cost == m_cost && h->t_cost == t_cost &&
+            h->lanes == lanes) {
+            return h;
+        }
+    }
+    if (metrics->histograms == ARGON2_METRICS_TUPLES) {
+        return &metrics->other;
+    }
+    h = &metrics->histogram[metrics->histograms++];
+    memset(h, 0, sizeof(*h));
+    h->type = type;
+    h->m_cost = m_cost;
+    h->t_cost = t_cost;
+    h->lanes = lanes;
+    return h;
+}
+
+static void histogram_add(argon2_metrics_histogram *total,
+                          const argon2_metrics_histogram *part) {
+    uint32_t i;
+
+    total->count += part->count;
+    total->sum_ns += part->sum_ns;
+    for (i = 0; i < ARGON2_METRICS_BUCKETS; ++i) {
+        total->buckets[i] += part->buckets[i];
+    }
+}
+
+/*
+ * Adds @part to @total. A shard's allocated_bytes goes "negative" when its
+ * thread frees memory another thread allocated; the wrapped sums still add
+ * up to the right total.
+ */
+static void metrics_add(argon2_metrics *total, const argon2_metrics *part) {
+    const argon2_metrics_histogram *h;
+    uint32_t i;
+
+    for (i = 0; i < 3; ++i) {
+        total->hashes[i] += part->hashes[i];
+        total->verifies[i] += part->verifies[i];
+    }
+    for (i = 0; i < ARGON2_METRICS_ERRORS; ++i) {
+        total->failures[i] += part->failures[i];
+    }
+    total->allocated_bytes += part->allocated_bytes;
+    for (i = 0; i < part->histograms; ++i) {
+        h = &part->histogram[i];
+        histogram_add(histogram_of(total, h->type, h->m_cost, h->t_cost,
+                                   h->lanes),
+                      h);
+    }
+    histogram_add(&total->other, &part->other);
+}
+
+/***************Thread shards*****************/
+
+static void shard_link(argon2_metrics_shard *shard) {
+    argon2_mutex_lock(&shards_lock);
+    shard->prev = NULL;
+    shard->next = shards;
+    if (shards != NULL) {
+        shards->prev = shard;
+    }
+    shards = shard;
+    argon2_mutex_unlock(&shards_lock);
+}
+
+#if defined(ARGON2_NO_THREADS)
+
+/* Everything counts into retired */
+static int shard_key_create(void) { return -1; }
+static argon2_metrics_shard *shard_key_get(void) { return NULL; }
+static int shard_key_set(argon2_metrics_shard *shard) {
+    (void)shard;
+    return -1;
+}
+
+#else
+
+/* Hands the counts of an exiting thread over to retired */
+static void shard_destroy(argon2_metrics_shard *shard) {
+    argon2_mutex_lock(&shards_lock);
+    argon2_mutex_lock(&retired_lock);
+    metrics_add(&retired, &shard->counts);
+    argon2_mutex_unlock(&retired_lock);
+    if (shard->prev != NULL) {
+        shard->prev->next = shard->next;
+    } else {
+        shards = shard->next;
+    }
+    if (shard->next != NULL) {
+        shard->next->prev = shard->prev;
+    }
+    argon2_mutex_unlock(&shards_lock);
+    argon2_mutex_destroy(&shard->lock);
+    free(shard);
+}
+
+#if defined(_WIN32)
+
+static DWORD shard_key = FLS_OUT_OF_INDEXES;
+static VOID WINAPI shard_key_destructor(PVOID shard) {
+    if (shard != NULL) {
+        shard_destroy(shard);
+    }
+}
+static int shard_key_create(void) {
+    if (shard_key == FLS_OUT_OF_INDEXES) {
+        shard_key = FlsAlloc(shard_key_destructor);
+    }
+    return shard_key == FLS_OUT_OF_INDEXES ? -1 : 0;
+}
+static argon2_metrics_shard *shard_key_lookup(void) {
+    return shard_key == FLS_OUT_OF_INDEXES ? NULL : FlsGetValue(shard_key);
+}
+static int shard_key_store(argon2_metrics_shard *shard) {
+    return FlsSetValue(shard_key, shard) ? 0 : -1;
+}
+
+#else
+
+static pthread_key_t shard_key;
+static int shard_key_created = 0;
+static void shard_key_destructor(void *shard) { shard_destroy(shard); }
+static int shard_key_create(void) {
+    if (!shard_key_created) {
+        if (pthread_key_create(&shard_key, shard_key_destructor) != 0) {
+            return -1;
+        }
+        shard_key_created = 1;
+    }
+    return 0;
+}
+static argon2_metrics_shard *shard_key_lookup(void) {
+    return shard_key_created ? pthread_getspecific(shard_key) : NULL;
+}
+static int shard_key_store(argon2_metrics_shard *shard) {
+    return pthread_setspecific(shard_key, shard);
+}
+
+#endif
+
+static argon2_metrics_shard *shard_key_get(void) { return shard_key_lookup(); }
+static int shard_key_set(argon2_metrics_shard *shard) {
+    return shard_key_store(shard);
+}
+
+#endif /* ARGON2_NO_THREADS */
+
+/* Gives the calling thread a shard of its own, NULL if it cannot have one */
+static argon2_metrics_shard *shard_create(void) {
+    argon2_metrics_shard *shard;
+    int created;
+
+    argon2_mutex_lock(&shards_lock);
+    created = shard_key_create();
+    argon2_mutex_unlock(&shards_lock);
+    if (created != 0) {
+        return NULL;
+    }
+
+    shard = malloc(sizeof(*shard));
+    if (shard == NULL) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(*shard));
+    argon2_mutex_init(&shard->lock);
+    if (shard_key_set(shard) != 0) {
+        argon2_mutex_destroy(&shard->lock);
+        free(shard);
+        return NULL;
+    }
+    shard_link(shard);
+    return shard;
+}
+
+/*
+ * Locks the counts of the calling thread's shard, or retired if it cannot
+ * have one
+ * @param lock Receives the lock to release after the update
+ */
+static argon2_metrics *counts_lock(argon2_mutex_t **lock) {
+    argon2_metrics_shard *shard = shard_key_get();
+
+    if (shard == NULL) {
+        shard = shard_create();
+    }
+    if (shard == NULL) {
+        *lock = &retired_lock;
+        argon2_mutex_lock(*lock);
+        return &retired;
+    }
+    *lock = &shard->lock;
+    argon2_mutex_lock(*lock);
+    return &shard->counts;
+}
+
+/***************Counting functions*****************/
+
+void metrics_hash(const argon2_context *context, argon2_type type,
+                  uint64_t elapsed_ns) {
+    argon2_mutex_t *lock;
+    argon2_metrics *counts = counts_lock(&lock);
+    argon2_metrics_histogram *h;
+    uint32_t bucket = bucket_of(elapsed_ns);
+
+    counts->hashes[type]++;
+    h = histogram_of(counts, type, context->m_cost, context->t_cost,
+                     context->lanes);
+    h->count++;
+    h->sum_ns += elapsed_ns;
+    if (bucket < ARGON2_METRICS_BUCKETS) {
+        h->buckets[bucket]++;
+    }
+    argon2_mutex_unlock(lock);
+}
+
+int metrics_failure(int error_code) {
+    argon2_mutex_t *lock;
+    argon2_metrics *counts;
+
+    if (error_code < 0 && -error_code < ARGON2_METRICS_ERRORS) {
+        counts = counts_lock(&lock);
+        counts->failures[-error_code]++;
+        argon2_mutex_unlock(lock);
+    }
+    return error_code;
+}
+
+void metrics_verify(argon2_type type, int result) {
+    argon2_mutex_t *lock;
+    argon2_metrics *counts;
+
+    if (Argon2_d != type && Argon2_i != type && Argon2_id != type) {
+        return;
+    }
+    counts = counts_lock(&lock);
+    counts->verifies[type]++;
+    if (result == ARGON2_VERIFY_MISMATCH) {
+        counts->failures[-ARGON2_VERIFY_MISMATCH]++;
+    }
+    argon2_mutex_unlock(lock);
+}
+
+void metrics_memory(size_t allocated, size_t freed) {
+    argon2_mutex_t *lock;
+    argon2_metrics *counts = counts_lock(&lock);
+
+    counts->allocated_bytes += allocated;
+    counts->allocated_bytes -= freed;
+    argon2_mutex_unlock(lock);
+}
+
+/***************OpenMetrics text*****************/
+
+typedef struct Argon2_metrics_writer {
+    char *out;
+    size_t outlen;
+    size_t len; /* of the whole text, even past outlen */
+} argon2_metrics_writer;
+
+static void put(argon2_metrics_writer *w, const char *s) {
+    for (; *s != '\0'; ++s, ++w->len) {
+        if (w->len + 1 < w->outlen) {
+            w->out[w->len] = *s;
+        }
+    }
+}
+
+static void put_u64(argon2_metrics_writer *w, uint64_t x) {
+    char digits[21];
+    char *p = digits + sizeof(digits) - 1;
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + x % 10);
+        x /= 10;
+    } while (x != 0);
+    put(w, p);
+}
+
+/* Nanoseconds as seconds, without trailing zeros */
+static void put_seconds(argon2_metrics_writer *w, uint64_t ns) {
+    char frac[11];
+    uint32_t rest = (uint32_t)(ns % 1000000000);
+    int i;
+
+    put_u64(w, ns / 1000000000);
+    if (rest == 0) {
+        return;
+    }
+    frac[0] = '.';
+    for (i = 9; i >= 1; --i) {
+        frac[i] = (char)('0' + rest % 10);
+        rest /= 10;
+    }
+    for (i = 9; frac[i] == '0'; --i) {
+    }
+    frac[i + 1] = '\0';
+    put(w, frac);
+}
+
+static void put_family(argon2_metrics_writer *w, const char *name,
+                       const char *type, const char *unit, const char *help) {
+    put(w, "# TYPE ");
+    put(w, name);
+    put(w, " ");
+    put(w, type);
+    put(w, "\n");
+    if (unit != NULL) {
+        put(w, "# UNIT ");
+        put(w, name);
+        put(w, " ");
+        put(w, unit);
+        put(w, "\n");
+    }
+    put(w, "# HELP ");
+    put(w, name);
+    put(w, " ");
+    put(w, help);
+    put(w, "\n");
+}
+
+static void put_by_type(argon2_metrics_writer *w, const char *name,
+                        const uint64_t *counts) {
+    uint32_t i;
+
+    for (i = 0; i < 3; ++i) {
+        put(w, name);
+        put(w, "{type=\"");
+        put(w, argon2_type2string((argon2_type)i, 0));
+        put(w, "\"} ");
+        put_u64(w, counts[i]);
+        put(w, "\n");
+    }
+}
+
+/* Writes one labelled sample of the latency histogram */
+static void put_histogram_sample(argon2_metrics_writer *w, const char *suffix,
+                                 const argon2_metrics_histogram *h, int other,
+                                 const char *le) {
+    put(w, "argon2_hash_duration_seconds_");
+    put(w, suffix);
+    if (other) {
+        put(w, "{type=\"other\",m_cost=\"other\",t_cost=\"other\","
+               "lanes=\"other\"");
+    } else {
+        put(w, "{type=\"");
+        put(w, argon2_type2string(h->type, 0));
+        put(w, "\",m_cost=\"");
+        put_u64(w, h->m_cost);
+        put(w, "\",t_cost=\"");
+        put_u64(w, h->t_cost);
+        put(w, "\",lanes=\"");
+        put_u64(w, h->lanes);
+        put(w, "\"");
+    }
+    if (le != NULL) {
+        put(w, ",le=\"");
+        put(w, le);
+        put(w, "\"");
+    }
+    put(w, "} ");
+}
+
+static void put_histogram(argon2_metrics_writer *w,
+                          const argon2_metrics_histogram *h, int other) {
+    argon2_metrics_writer bound;
+    char le[32];
+    uint64_t cumulative = 0;
+    uint32_t i;
+
+    for (i = 0; i < ARGON2_METRICS_BUCKETS; ++i) {
+        bound.out = le;
+        bound.outlen = sizeof(le);
+        bound.len = 0;
+        put_seconds(&bound, argon2_metrics_bucket_ns(i));
+        le[bound.len] = '\0';
+
+        cumulative += h->buckets[i];
+        put_histogram_sample(w, "bucket", h, other, le);
+        put_u64(w, cumulative);
+        put(w, "\n");
+    }
+    put_histogram_sample(w, "bucket", h, other, "+Inf");
+    put_u64(w, h->count);
+    put(w, "\n");
+    put_histogram_sample(w, "count", h, other, NULL);
+    put_u64(w, h->count);
+    put(w, "\n");
+    put_histogram_sample(w, "sum", h, other, NULL);
+    put_seconds(w, h->sum_ns);
+    put(w, "\n");
+}
+
+/***************Public interface*****************/
+
+void argon2_metrics_snapshot(argon2_metrics *metrics) {
+    argon2_metrics_shard *shard;
+
+    if (metrics == NULL) {
+        return;
+    }
+    memset(metrics, 0, sizeof(*metrics));
+
+    argon2_mutex_lock(&shards_lock);
+    argon2_mutex_lock(&retired_lock);
+    metrics_add(metrics, &retired);
+    argon2_mutex_unlock(&retired_lock);
+    for (shard = shards; shard != NULL; shard = shard->next) {
+        argon2_mutex_lock(&shard->lock);
+        metrics_add(metrics, &shard->counts);
+        argon2_mutex_unlock(&shard->lock);
+    }
+    argon2_mutex_unlock(&shards_lock);
+
+    executor_load(&metrics->active_workers, &metrics->queued_segments,
+                  &metrics->thread_cap, &metrics->last_threads);
+}
+
+uint64_t argon2_metrics_bucket_ns(uint32_t bucket) {
+    if (bucket >= ARGON2_METRICS_BUCKETS) {
+        return UINT64_MAX;
+    }
+    /* Four steps of 2^(14 + octave) above 2^(16 + octave) */
+    return (uint64_t)(5 + bucket % 4) << (14 + bucket / 4);
+}
+
+size_t argon2_metrics_openmetrics(const argon2_metrics *metrics, char *out,
+                                  size_t outlen) {
+    argon2_metrics_writer w;
+    uint32_t i;
+
+    w.out = out;
+    w.outlen = out != NULL ? outlen : 0;
+    w.len = 0;
+    if (metrics == NULL) {
+        if (w.outlen != 0) {
+            out[0] = '\0';
+        }
+        return 0;
+    }
+
+    put_family(&w, "argon2_hashes", "counter", NULL, "Successful hashes.");
+    put_by_type(&w, "argon2_hashes_total", metrics->hashes);
+
+    put_family(&w, "argon2_verifies", "counter", NULL, "Password verifies.");
+    put_by_type(&w, "argon2_verifies_total", metrics->verifies);
+
+    put_family(&w, "argon2_failures", "counter", NULL,
+               "Failed hashes and mismatching verifies, by error code.");
+    for (i = 1; i < ARGON2_METRICS_ERRORS; ++i) {
+        if (metrics->failures[i] != 0) {
+            put(&w, "argon2_failures_total{code=\"-");
+            put_u64(&w, i);
+            put(&w, "\"} ");
+            put_u64(&w, metrics->failures[i]);
+            put(&w, "\n");
+        }
+    }
+
+    put_family(&w, "argon2_allocated_bytes", "gauge", "bytes",
+               "Memory blocks allocated by running hashes.");
+    put(&w, "argon2_allocated_bytes ");
+    put_u64(&w, metrics->allocated_bytes);
+    put(&w, "\n");
+
+    put_family(&w, "argon2_active_workers", "gauge", NULL,
+               "Segments being filled.");
+    put(&w, "argon2_active_workers ");
+    put_u64(&w, metrics->active_workers);
+    put(&w, "\n");
+
+    put_family(&w, "argon2_queued_segments", "gauge", NULL,
+               "Segments waiting for an executor slot.");
+    put(&w, "argon2_queued_segments ");
+    put_u64(&w, metrics->queued_segments);
+    put(&w, "\n");
+
+    put_family(&w, "argon2_thread_cap", "gauge", NULL,
+               "Most threads a hash may use, 0 for no cap.");
+    put(&w, "argon2_thread_cap ");
+    put_u64(&w, metrics->thread_cap);
+    put(&w, "\n");
+
+    put_family(&w, "argon2_last_threads", "gauge", NULL,
+               "Threads of the most recently started hash.");
+    put(&w, "argon2_last_threads ");
+    put_u64(&w, metrics->last_threads);
+    put(&w, "\n");
+
+    put_family(&w, "argon2_hash_duration_seconds", "histogram", "seconds",
+               "Latency of successful hashes, by parameter set.");
+    for (i = 0; i < metrics->histograms && i < ARGON2_METRICS_TUPLES; ++i) {
+        put_histogram(&w, &metrics->histogram[i], 0);
+    }
+    if (metrics->other.count != 0) {
+        put_histogram(&w, &metrics->other, 1);
+    }
+
+    put(&w, "# EOF\n");
+    if (w.outlen != 0) {
+        out[w.len < w.outlen ? w.len : w.outlen - 1] = '\0';
+    }
+    return w.len;
+}
@@ -0,0 +1,47 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef ARGON2_METRICS_H
+#define ARGON2_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "argon2.h"
+
+/*
+ * Counting side of argon2_metrics_snapshot(). Every function updates the
+ * calling thread's shard.
+ */
+
+/* Records a successful hash of @context's parameters that took @elapsed_ns */
+void metrics_hash(const argon2_context *context, argon2_type type,
+                  uint64_t elapsed_ns);
+
+/*
+ * Records a failed hash
+ * @return @error_code, for returning it on
+ */
+int metrics_failure(int error_code);
+
+/* Records a verify that ended with @result; a mismatch counts as failure */
+void metrics_verify(argon2_type type, int result);
+
+/* Records memory blocks obtained from or handed back to allocate_memory() */
+void metrics_memory(size_t allocated, size_t freed);
+
+#endif
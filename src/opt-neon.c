@@ -0,0 +1,216 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "argon2.h"
+#include "core.h"
+
+#include "blake2/blake2.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include "blake2/blamka-round-neon.h"
+
+/* Resolves and prefetches the reference block of the following block */
+static void resolve_next_ref(argon2_next_ref_t *next_ref, uint64_t pseudo_rand) {
+    next_ref->ref_block =
+        reference_block(next_ref->instance, &next_ref->position, pseudo_rand);
+    ARGON2_PREFETCH_BLOCK(next_ref->ref_block);
+}
+
+/*
+ * Function fills a new memory block and optionally XORs the old block over the new one.
+ * NEON loads and stores have no alignment requirement, so unlike opt.c there
+ * is no aligned variant.
+ * @param state Pointer to the just produced block. Content will be updated(!)
+ * @param ref_block Pointer to the reference block
+ * @param next_block Pointer to the block to be XORed over. May coincide with @ref_block
+ * @param with_xor Whether to XOR into the new block (1) or just overwrite (0)
+ * @param next_ref If not NULL, the reference block of the following block is
+ * resolved from the first word of @next_block and prefetched before the rest
+ * of @next_block is stored
+ * @pre all block pointers must be valid
+ */
+static void fill_block(uint64x2_t *state, const block *ref_block,
+                       block *next_block, int with_xor,
+                       argon2_next_ref_t *next_ref) {
+    uint64x2_t block_XY[ARGON2_OWORDS_IN_BLOCK];
+    unsigned int i;
+
+    if (with_xor) {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            state[i] = veorq_u64(state[i], vld1q_u64(ref_block->v + 2 * i));
+            block_XY[i] = veorq_u64(state[i], vld1q_u64(next_block->v + 2 * i));
+        }
+    } else {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            block_XY[i] = state[i] =
+                veorq_u64(state[i], vld1q_u64(ref_block->v + 2 * i));
+        }
+    }
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND_NEON(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2],
+            state[8 * i + 3], state[8 * i + 4], state[8 * i + 5],
+            state[8 * i + 6], state[8 * i + 7]);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND_NEON(state[8 * 0 + i], state[8 * 1 + i], state[8 * 2 + i],
+            state[8 * 3 + i], state[8 * 4 + i], state[8 * 5 + i],
+            state[8 * 6 + i], state[8 * 7 + i]);
+    }
+
+    /* The first word decides the next reference block: store it first */
+    state[0] = veorq_u64(state[0], block_XY[0]);
+    vst1q_u64(next_block->v, state[0]);
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, next_block->v[0]);
+    }
+
+    for (i = 1; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+        state[i] = veorq_u64(state[i], block_XY[i]);
+        vst1q_u64(next_block->v + 2 * i, state[i]);
+    }
+}
+
+static void next_addresses(block *address_block, block *input_block) {
+    uint64x2_t zero_block[ARGON2_OWORDS_IN_BLOCK];
+    uint64x2_t zero2_block[ARGON2_OWORDS_IN_BLOCK];
+
+    memset(zero_block, 0, sizeof(zero_block));
+    memset(zero2_block, 0, sizeof(zero2_block));
+
+    /*Increasing index counter*/
+    input_block->v[6]++;
+
+    /*First iteration of G*/
+    fill_block(zero_block, input_block, address_block, 0, NULL);
+
+    /*Second iteration of G*/
+    fill_block(zero2_block, address_block, address_block, 0, NULL);
+}
+
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+    block *ref_block = NULL, *curr_block = NULL;
+    block address_block, input_block;
+    block *ref_blocks[ARGON2_ADDRESSES_IN_BLOCK];
+    argon2_next_ref_t next_ref;
+    uint64_t pseudo_rand;
+    uint32_t prev_offset, curr_offset;
+    uint32_t starting_index, i, address, addresses_end = 0;
+    uint64x2_t state[ARGON2_OWORDS_IN_BLOCK];
+    int data_independent_addressing;
+
+    if (instance == NULL) {
+        return;
+    }
+
+    data_independent_addressing =
+        (instance->type == Argon2_i) ||
+        (instance->type == Argon2_id && (position.pass == 0) &&
+         (position.slice < ARGON2_SYNC_POINTS / 2));
+
+    if (data_independent_addressing) {
+        init_block_value(&input_block, 0);
+
+        input_block.v[0] = position.pass;
+        input_block.v[1] = position.lane;
+        input_block.v[2] = position.slice;
+        input_block.v[3] = instance->memory_blocks;
+        input_block.v[4] = instance->passes;
+        input_block.v[5] = instance->type;
+    }
+
+    starting_index = 0;
+
+    if ((0 == position.pass) && (0 == position.slice)) {
+        starting_index = 2;
+
+        if (data_independent_addressing) {
+            next_addresses(&address_block, &input_block);
+        }
+    }
+
+    curr_offset = position.lane * instance->lane_length +
+                  position.slice * instance->segment_length + starting_index;
+
+    if (0 == curr_offset % instance->lane_length) {
+        prev_offset = curr_offset + instance->lane_length - 1;
+    } else {
+        prev_offset = curr_offset - 1;
+    }
+
+    memcpy(state, ((instance->memory + prev_offset)->v), ARGON2_BLOCK_SIZE);
+
+    next_ref.instance = instance;
+    next_ref.position = position;
+    next_ref.ref_block = NULL;
+
+    for (i = starting_index; i < instance->segment_length;
+         ++i, ++curr_offset, ++prev_offset) {
+        if (curr_offset % instance->lane_length == 1) {
+            prev_offset = curr_offset - 1;
+        }
+
+        position.index = i;
+        if (data_independent_addressing) {
+            address = i % ARGON2_ADDRESSES_IN_BLOCK;
+            if (address == 0) {
+                next_addresses(&address_block, &input_block);
+            }
+            if (address == 0 || i == starting_index) {
+                /* Map the whole (rest of the) address block at once */
+                position.index = i - address;
+                addresses_end = instance->segment_length - position.index;
+                if (addresses_end > ARGON2_ADDRESSES_IN_BLOCK) {
+                    addresses_end = ARGON2_ADDRESSES_IN_BLOCK;
+                }
+                index_alpha_block(instance, &position, &address_block,
+                                  address, addresses_end - address,
+                                  ref_blocks);
+                position.index = i;
+            }
+            ref_block = ref_blocks[address];
+            if (address + 1 < addresses_end) {
+                ARGON2_PREFETCH_BLOCK(ref_blocks[address + 1]);
+            }
+        } else if (next_ref.ref_block != NULL) {
+            /* Already resolved while the previous block was stored */
+            ref_block = next_ref.ref_block;
+        } else {
+            pseudo_rand = instance->memory[prev_offset].v[0];
+            ref_block = reference_block(instance, &position, pseudo_rand);
+        }
+
+        next_ref.position.index = i + 1;
+        curr_block = instance->memory + curr_offset;
+        fill_block(state, ref_block, curr_block,
+                   /* version 1.2.1 and earlier: overwrite, not XOR */
+                   ARGON2_VERSION_10 != instance->version && 0 != position.pass,
+                   (data_independent_addressing ||
+                    i + 1 == instance->segment_length) ? NULL : &next_ref);
+    }
+}
+
+#else
+#error "This file requires NEON support. Use opt.c for x86 or ref.c for scalar."
+#endif /* __ARM_NEON */
@@ -25,25 +25,58 @@ typedef vector unsigned long long vsx_block_t;
 
 #define ARGON2_VSX_OWORDS_IN_BLOCK (ARGON2_BLOCK_SIZE / 16)
 
+/* Resolves and prefetches the reference block of the following block */
+static void resolve_next_ref(argon2_next_ref_t *next_ref, uint64_t pseudo_rand) {
+    next_ref->ref_block =
+        reference_block(next_ref->instance, &next_ref->position, pseudo_rand);
+    ARGON2_PREFETCH_BLOCK(next_ref->ref_block);
+}
+
 /*
  * Function fills a new memory block and optionally XORs the old block over the new one.
+ * The R = state ^ ref_block temporary is parked in @next_block itself, which is
+ * about to be overwritten anyway, so no separate block_XY scratch is needed and
+ * the with_xor read-modify-write of @next_block happens in the same pass.
+ * @param state Pointer to the just produced block. Content will be updated(!)
+ * @param ref_block Pointer to the reference block
+ * @param next_block Pointer to the block to be XORed over. May coincide with @ref_block
+ * @param with_xor Whether to XOR into the new block (1) or just overwrite (0)
+ * @param aligned Whether @ref_block and @next_block are 16-byte aligned
+ * @param next_ref If not NULL, the reference block of the following block is
+ * resolved from the first word of @next_block and prefetched before the rest
+ * of @next_block is stored
+ * @pre all block pointers must be valid
  */
 static void fill_block(vsx_block_t *state, const block *ref_block,
-                       block *next_block, int with_xor) {
-    vsx_block_t block_XY[ARGON2_VSX_OWORDS_IN_BLOCK];
+                       block *next_block, int with_xor, int aligned,
+                       argon2_next_ref_t *next_ref) {
+    const uint64_t *ref = ref_block->v;
+    uint64_t *next = next_block->v;
     unsigned int i;
 
-    if (with_xor) {
-        for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
-            state[i] = vec_xor(
-                state[i], VSX_LOADU((const uint64_t *)ref_block->v + i*2));
-            block_XY[i] = vec_xor(
-                state[i], VSX_LOADU((const uint64_t *)next_block->v + i*2));
+    if (aligned) {
+        if (with_xor) {
+            for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+                state[i] = vec_xor(state[i], VSX_LOAD(ref + i*2));
+                VSX_STORE(next + i*2, vec_xor(state[i], VSX_LOAD(next + i*2)));
+            }
+        } else {
+            for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+                state[i] = vec_xor(state[i], VSX_LOAD(ref + i*2));
+                VSX_STORE(next + i*2, state[i]);
+            }
         }
     } else {
-        for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
-            block_XY[i] = state[i] = vec_xor(
-                state[i], VSX_LOADU((const uint64_t *)ref_block->v + i*2));
+        if (with_xor) {
+            for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+                state[i] = vec_xor(state[i], VSX_LOADU(ref + i*2));
+                VSX_STOREU(next + i*2, vec_xor(state[i], VSX_LOADU(next + i*2)));
+            }
+        } else {
+            for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+                state[i] = vec_xor(state[i], VSX_LOADU(ref + i*2));
+                VSX_STOREU(next + i*2, state[i]);
+            }
         }
     }
 
@@ -61,10 +94,29 @@ static void fill_block(vsx_block_t *state, const block *ref_block,
             state[8 * 6 + i], state[8 * 7 + i]);
     }
 
-    /* XOR and store */
-    for (i = 0; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
-        state[i] = vec_xor(state[i], block_XY[i]);
-        VSX_STOREU((uint64_t *)next_block->v + i*2, state[i]);
+    /* XOR with the parked R (and old block) and store; the first word
+     * decides the next reference block, so it goes first */
+    if (aligned) {
+        state[0] = vec_xor(state[0], VSX_LOAD(next));
+        VSX_STORE(next, state[0]);
+    } else {
+        state[0] = vec_xor(state[0], VSX_LOADU(next));
+        VSX_STOREU(next, state[0]);
+    }
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, next[0]);
+    }
+
+    if (aligned) {
+        for (i = 1; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+            state[i] = vec_xor(state[i], VSX_LOAD(next + i*2));
+            VSX_STORE(next + i*2, state[i]);
+        }
+    } else {
+        for (i = 1; i < ARGON2_VSX_OWORDS_IN_BLOCK; i++) {
+            state[i] = vec_xor(state[i], VSX_LOADU(next + i*2));
+            VSX_STOREU(next + i*2, state[i]);
+        }
     }
 }
 
@@ -77,19 +129,22 @@ static void next_addresses(block *address_block, block *input_block) {
 
     input_block->v[6]++;
 
-    fill_block(zero_block, input_block, address_block, 0);
-    fill_block(zero2_block, address_block, address_block, 0);
+    fill_block(zero_block, input_block, address_block, 0, 0, NULL);
+    fill_block(zero2_block, address_block, address_block, 0, 0, NULL);
 }
 
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position) {
     block *ref_block = NULL, *curr_block = NULL;
     block address_block, input_block;
-    uint64_t pseudo_rand, ref_index, ref_lane;
+    block *ref_blocks[ARGON2_ADDRESSES_IN_BLOCK];
+    argon2_next_ref_t next_ref;
+    uint64_t pseudo_rand;
     uint32_t prev_offset, curr_offset;
-    uint32_t starting_index, i;
+    uint32_t starting_index, i, address, addresses_end = 0;
     vsx_block_t state[ARGON2_VSX_OWORDS_IN_BLOCK];
     int data_independent_addressing;
+    int aligned;
 
     if (instance == NULL) {
         return;
@@ -100,6 +155,9 @@ void fill_segment(const argon2_instance_t *instance,
         (instance->type == Argon2_id && (position.pass == 0) &&
          (position.slice < ARGON2_SYNC_POINTS / 2));
 
+    /* Blocks are 1 KiB, so an aligned arena means every block is aligned */
+    aligned = ((uintptr_t)instance->memory & 15) == 0;
+
     if (data_independent_addressing) {
         init_block_value(&input_block, 0);
 
@@ -132,43 +190,54 @@ void fill_segment(const argon2_instance_t *instance,
 
     memcpy(state, ((instance->memory + prev_offset)->v), ARGON2_BLOCK_SIZE);
 
+    next_ref.instance = instance;
+    next_ref.position = position;
+    next_ref.ref_block = NULL;
+
     for (i = starting_index; i < instance->segment_length;
          ++i, ++curr_offset, ++prev_offset) {
         if (curr_offset % instance->lane_length == 1) {
             prev_offset = curr_offset - 1;
         }
 
+        position.index = i;
         if (data_independent_addressing) {
-            if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) {
+            address = i % ARGON2_ADDRESSES_IN_BLOCK;
+            if (address == 0) {
                 next_addresses(&address_block, &input_block);
             }
-            pseudo_rand = address_block.v[i % ARGON2_ADDRESSES_IN_BLOCK];
+            if (address == 0 || i == starting_index) {
+                /* Map the whole (rest of the) address block at once */
+                position.index = i - address;
+                addresses_end = instance->segment_length - position.index;
+                if (addresses_end > ARGON2_ADDRESSES_IN_BLOCK) {
+                    addresses_end = ARGON2_ADDRESSES_IN_BLOCK;
+                }
+                index_alpha_block(instance, &position, &address_block,
+                                  address, addresses_end - address,
+                                  ref_blocks);
+                position.index = i;
+            }
+            ref_block = ref_blocks[address];
+            if (address + 1 < addresses_end) {
+                ARGON2_PREFETCH_BLOCK(ref_blocks[address + 1]);
+            }
+        } else if (next_ref.ref_block != NULL) {
+            /* Already resolved while the previous block was stored */
+            ref_block = next_ref.ref_block;
         } else {
             pseudo_rand = instance->memory[prev_offset].v[0];
+            ref_block = reference_block(instance, &position, pseudo_rand);
         }
 
-        ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
-
-        if ((position.pass == 0) && (position.slice == 0)) {
-            ref_lane = position.lane;
-        }
-
-        position.index = i;
-        ref_index = index_alpha(instance, &position, pseudo_rand & 0xFFFFFFFF,
-                                ref_lane == position.lane);
-
-        ref_block =
-            instance->memory + instance->lane_length * ref_lane + ref_index;
+        next_ref.position.index = i + 1;
         curr_block = instance->memory + curr_offset;
-        if (ARGON2_VERSION_10 == instance->version) {
-            fill_block(state, ref_block, curr_block, 0);
-        } else {
-            if(0 == position.pass) {
-                fill_block(state, ref_block, curr_block, 0);
-            } else {
-                fill_block(state, ref_block, curr_block, 1);
-            }
-        }
+        fill_block(state, ref_block, curr_block,
+                   /* version 1.2.1 and earlier: overwrite, not XOR */
+                   ARGON2_VERSION_10 != instance->version && 0 != position.pass,
+                   aligned,
+                   (data_independent_addressing ||
+                    i + 1 == instance->segment_length) ? NULL : &next_ref);
     }
 }
 
@@ -25,6 +25,13 @@
 #include "blake2/blake2.h"
 #include "blake2/blamka-round-opt.h"
 
+/* Resolves and prefetches the reference block of the following block */
+static void resolve_next_ref(argon2_next_ref_t *next_ref, uint64_t pseudo_rand) {
+    next_ref->ref_block =
+        reference_block(next_ref->instance, &next_ref->position, pseudo_rand);
+    ARGON2_PREFETCH_BLOCK(next_ref->ref_block);
+}
+
 /*
  * Function fills a new memory block and optionally XORs the old block over the new one.
  * Memory must be initialized.
@@ -32,25 +39,36 @@
  * @param ref_block Pointer to the reference block
  * @param next_block Pointer to the block to be XORed over. May coincide with @ref_block
  * @param with_xor Whether to XOR into the new block (1) or just overwrite (0)
+ * @param aligned Whether @ref_block and @next_block are aligned to the vector
+ * width, so aligned loads and stores can be used
+ * @param next_ref If not NULL, the reference block of the following block is
+ * resolved from the first word of @next_block and prefetched before the rest
+ * of @next_block is stored
  * @pre all block pointers must be valid
  */
 #if defined(__AVX512F__)
+#define LOAD_VEC(p, aligned)                                                   \
+    ((aligned) ? _mm512_load_si512(p) : _mm512_loadu_si512(p))
+#define STORE_VEC(p, v, aligned)                                               \
+    ((aligned) ? _mm512_store_si512((p), (v)) : _mm512_storeu_si512((p), (v)))
+
 static void fill_block(__m512i *state, const block *ref_block,
-                       block *next_block, int with_xor) {
+                       block *next_block, int with_xor, int aligned,
+                       argon2_next_ref_t *next_ref) {
     __m512i block_XY[ARGON2_512BIT_WORDS_IN_BLOCK];
     unsigned int i;
 
     if (with_xor) {
         for (i = 0; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++) {
             state[i] = _mm512_xor_si512(
-                state[i], _mm512_loadu_si512((const __m512i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m512i *)ref_block->v + i, aligned));
             block_XY[i] = _mm512_xor_si512(
-                state[i], _mm512_loadu_si512((const __m512i *)next_block->v + i));
+                state[i], LOAD_VEC((const __m512i *)next_block->v + i, aligned));
         }
     } else {
         for (i = 0; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++) {
             block_XY[i] = state[i] = _mm512_xor_si512(
-                state[i], _mm512_loadu_si512((const __m512i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m512i *)ref_block->v + i, aligned));
         }
     }
 
@@ -66,28 +84,41 @@ static void fill_block(__m512i *state, const block *ref_block,
             state[2 * 4 + i], state[2 * 5 + i], state[2 * 6 + i], state[2 * 7 + i]);
     }
 
-    for (i = 0; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++) {
+    /* The first word decides the next reference block: store it first */
+    state[0] = _mm512_xor_si512(state[0], block_XY[0]);
+    STORE_VEC((__m512i *)next_block->v, state[0], aligned);
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, next_block->v[0]);
+    }
+
+    for (i = 1; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++) {
         state[i] = _mm512_xor_si512(state[i], block_XY[i]);
-        _mm512_storeu_si512((__m512i *)next_block->v + i, state[i]);
+        STORE_VEC((__m512i *)next_block->v + i, state[i], aligned);
     }
 }
 #elif defined(__AVX2__)
+#define LOAD_VEC(p, aligned)                                                   \
+    ((aligned) ? _mm256_load_si256(p) : _mm256_loadu_si256(p))
+#define STORE_VEC(p, v, aligned)                                               \
+    ((aligned) ? _mm256_store_si256((p), (v)) : _mm256_storeu_si256((p), (v)))
+
 static void fill_block(__m256i *state, const block *ref_block,
-                       block *next_block, int with_xor) {
+                       block *next_block, int with_xor, int aligned,
+                       argon2_next_ref_t *next_ref) {
     __m256i block_XY[ARGON2_HWORDS_IN_BLOCK];
     unsigned int i;
 
     if (with_xor) {
         for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
             state[i] = _mm256_xor_si256(
-                state[i], _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m256i *)ref_block->v + i, aligned));
             block_XY[i] = _mm256_xor_si256(
-                state[i], _mm256_loadu_si256((const __m256i *)next_block->v + i));
+                state[i], LOAD_VEC((const __m256i *)next_block->v + i, aligned));
         }
     } else {
         for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
             block_XY[i] = state[i] = _mm256_xor_si256(
-                state[i], _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m256i *)ref_block->v + i, aligned));
         }
     }
 
@@ -101,28 +132,41 @@ static void fill_block(__m256i *state, const block *ref_block,
                        state[16 + i], state[20 + i], state[24 + i], state[28 + i]);
     }
 
-    for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
+    /* The first word decides the next reference block: store it first */
+    state[0] = _mm256_xor_si256(state[0], block_XY[0]);
+    STORE_VEC((__m256i *)next_block->v, state[0], aligned);
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, next_block->v[0]);
+    }
+
+    for (i = 1; i < ARGON2_HWORDS_IN_BLOCK; i++) {
         state[i] = _mm256_xor_si256(state[i], block_XY[i]);
-        _mm256_storeu_si256((__m256i *)next_block->v + i, state[i]);
+        STORE_VEC((__m256i *)next_block->v + i, state[i], aligned);
     }
 }
 #else
+#define LOAD_VEC(p, aligned)                                                   \
+    ((aligned) ? _mm_load_si128(p) : _mm_loadu_si128(p))
+#define STORE_VEC(p, v, aligned)                                               \
+    ((aligned) ? _mm_store_si128((p), (v)) : _mm_storeu_si128((p), (v)))
+
 static void fill_block(__m128i *state, const block *ref_block,
-                       block *next_block, int with_xor) {
+                       block *next_block, int with_xor, int aligned,
+                       argon2_next_ref_t *next_ref) {
     __m128i block_XY[ARGON2_OWORDS_IN_BLOCK];
     unsigned int i;
 
     if (with_xor) {
         for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
             state[i] = _mm_xor_si128(
-                state[i], _mm_loadu_si128((const __m128i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m128i *)ref_block->v + i, aligned));
             block_XY[i] = _mm_xor_si128(
-                state[i], _mm_loadu_si128((const __m128i *)next_block->v + i));
+                state[i], LOAD_VEC((const __m128i *)next_block->v + i, aligned));
         }
     } else {
         for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
             block_XY[i] = state[i] = _mm_xor_si128(
-                state[i], _mm_loadu_si128((const __m128i *)ref_block->v + i));
+                state[i], LOAD_VEC((const __m128i *)ref_block->v + i, aligned));
         }
     }
 
@@ -138,9 +182,16 @@ static void fill_block(__m128i *state, const block *ref_block,
             state[8 * 6 + i], state[8 * 7 + i]);
     }
 
-    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+    /* The first word decides the next reference block: store it first */
+    state[0] = _mm_xor_si128(state[0], block_XY[0]);
+    STORE_VEC((__m128i *)next_block->v, state[0], aligned);
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, next_block->v[0]);
+    }
+
+    for (i = 1; i < ARGON2_OWORDS_IN_BLOCK; i++) {
         state[i] = _mm_xor_si128(state[i], block_XY[i]);
-        _mm_storeu_si128((__m128i *)next_block->v + i, state[i]);
+        STORE_VEC((__m128i *)next_block->v + i, state[i], aligned);
     }
 }
 #endif
@@ -165,19 +216,21 @@ static void next_addresses(block *address_block, block *input_block) {
     input_block->v[6]++;
 
     /*First iteration of G*/
-    fill_block(zero_block, input_block, address_block, 0);
+    fill_block(zero_block, input_block, address_block, 0, 0, NULL);
 
     /*Second iteration of G*/
-    fill_block(zero2_block, address_block, address_block, 0);
+    fill_block(zero2_block, address_block, address_block, 0, 0, NULL);
 }
 
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position) {
     block *ref_block = NULL, *curr_block = NULL;
     block address_block, input_block;
-    uint64_t pseudo_rand, ref_index, ref_lane;
+    block *ref_blocks[ARGON2_ADDRESSES_IN_BLOCK];
+    argon2_next_ref_t next_ref;
+    uint64_t pseudo_rand;
     uint32_t prev_offset, curr_offset;
-    uint32_t starting_index, i;
+    uint32_t starting_index, i, address, addresses_end = 0;
 #if defined(__AVX512F__)
     __m512i state[ARGON2_512BIT_WORDS_IN_BLOCK];
 #elif defined(__AVX2__)
@@ -186,11 +239,16 @@ void fill_segment(const argon2_instance_t *instance,
     __m128i state[ARGON2_OWORDS_IN_BLOCK];
 #endif
     int data_independent_addressing;
+    int aligned;
 
     if (instance == NULL) {
         return;
     }
 
+    /* Blocks are 1 KiB, so an aligned arena means every block is aligned;
+     * memory from a custom allocate_cbk may not be */
+    aligned = ((uintptr_t)instance->memory % sizeof(state[0])) == 0;
+
     data_independent_addressing =
         (instance->type == Argon2_i) ||
         (instance->type == Argon2_id && (position.pass == 0) &&
@@ -232,6 +290,10 @@ void fill_segment(const argon2_instance_t *instance,
 
     memcpy(state, ((instance->memory + prev_offset)->v), ARGON2_BLOCK_SIZE);
 
+    next_ref.instance = instance;
+    next_ref.position = position;
+    next_ref.ref_block = NULL;
+
     for (i = starting_index; i < instance->segment_length;
          ++i, ++curr_offset, ++prev_offset) {
         /*1.1 Rotating prev_offset if needed */
@@ -239,45 +301,46 @@ void fill_segment(const argon2_instance_t *instance,
             prev_offset = curr_offset - 1;
         }
 
-        /* 1.2 Computing the index of the reference block */
-        /* 1.2.1 Taking pseudo-random value from the previous block */
+        /* 1.2 Computing the reference block */
+        position.index = i;
         if (data_independent_addressing) {
-            if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) {
+            address = i % ARGON2_ADDRESSES_IN_BLOCK;
+            if (address == 0) {
                 next_addresses(&address_block, &input_block);
             }
-            pseudo_rand = address_block.v[i % ARGON2_ADDRESSES_IN_BLOCK];
+            if (address == 0 || i == starting_index) {
+                /* Map the whole (rest of the) address block at once */
+                position.index = i - address;
+                addresses_end = instance->segment_length - position.index;
+                if (addresses_end > ARGON2_ADDRESSES_IN_BLOCK) {
+                    addresses_end = ARGON2_ADDRESSES_IN_BLOCK;
+                }
+                index_alpha_block(instance, &position, &address_block,
+                                  address, addresses_end - address,
+                                  ref_blocks);
+                position.index = i;
+            }
+            ref_block = ref_blocks[address];
+            if (address + 1 < addresses_end) {
+                ARGON2_PREFETCH_BLOCK(ref_blocks[address + 1]);
+            }
+        } else if (next_ref.ref_block != NULL) {
+            /* Already resolved while the previous block was stored */
+            ref_block = next_ref.ref_block;
         } else {
             pseudo_rand = instance->memory[prev_offset].v[0];
+            ref_block = reference_block(instance, &position, pseudo_rand);
         }
 
-        /* 1.2.2 Computing the lane of the reference block */
-        ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
-
-        if ((position.pass == 0) && (position.slice == 0)) {
-            /* Can not reference other lanes yet */
-            ref_lane = position.lane;
-        }
-
-        /* 1.2.3 Computing the number of possible reference block within the
-         * lane.
-         */
-        position.index = i;
-        ref_index = index_alpha(instance, &position, pseudo_rand & 0xFFFFFFFF,
-                                ref_lane == position.lane);
-
-        /* 2 Creating a new block */
-        ref_block =
-            instance->memory + instance->lane_length * ref_lane + ref_index;
+        /* 2 Creating a new block; in data-dependent mode fill_block() also
+         * resolves the reference block of the next one */
+        next_ref.position.index = i + 1;
         curr_block = instance->memory + curr_offset;
-        if (ARGON2_VERSION_10 == instance->version) {
-            /* version 1.2.1 and earlier: overwrite, not XOR */
-            fill_block(state, ref_block, curr_block, 0);
-        } else {
-            if(0 == position.pass) {
-                fill_block(state, ref_block, curr_block, 0);
-            } else {
-                fill_block(state, ref_block, curr_block, 1);
-            }
-        }
+        fill_block(state, ref_block, curr_block,
+                   /* version 1.2.1 and earlier: overwrite, not XOR */
+                   ARGON2_VERSION_10 != instance->version && 0 != position.pass,
+                   aligned,
+                   (data_independent_addressing ||
+                    i + 1 == instance->segment_length) ? NULL : &next_ref);
     }
 }
@@ -0,0 +1,78 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef ARGON2_PROBES_H
+#define ARGON2_PROBES_H
+
+/*
+ * USDT static probes, built with make USDT=1 (needs <sys/sdt.h>, from
+ * systemtap-sdt-dev or systemtap-sdt-devel) on Linux and compiled out
+ * everywhere else. A probe site is a single nop until a tracer attaches; its
+ * arguments are fields the hash keeps anyway, so nothing is computed for
+ * them. All probes belong to the "argon2" provider and pass
+ *
+ *   arg0 memory blocks (KiB), arg1 passes, arg2 lanes, arg3 type,
+ *   arg4 CLOCK_MONOTONIC nanoseconds at which the hash started
+ *
+ * followed by:
+ *
+ *   ctx_entry      (nothing more) the hash starts
+ *   alloc_done     the memory blocks are allocated
+ *   slice_done     arg5 pass, arg6 slice: all lanes reached a sync point
+ *   finalize       the memory is filled, the tag is computed next
+ *   wipe_done      the memory blocks are wiped (or handed back to a session)
+ *   ctx_return     arg5 result code
+ *
+ * argon2_begin() fires ctx_entry and alloc_done, argon2_step() slice_done,
+ * and argon2_finish() the rest; argon2_abort() fires wipe_done and
+ * ctx_return with ARGON2_CANCELLED. The tracer's own monotonic clock gives
+ * the time since the hash started, e.g.
+ *
+ *   bpftrace -e 'usdt:./libargon2.so:argon2:slice_done
+ *                { @[arg5, arg6] = hist(nsecs - arg4); }'
+ */
+
+#if defined(ARGON2_USDT) && defined(__linux__)
+#include <sys/sdt.h>
+
+#define ARGON2_PROBES 1
+
+/* Probe with the common arguments only */
+#define ARGON2_PROBE(name, instance)                                           \
+    DTRACE_PROBE5(argon2, name, (instance)->memory_blocks,                     \
+                  (instance)->passes, (instance)->lanes, (instance)->type,     \
+                  (instance)->start_ns)
+
+/* Probe with the common arguments and one or two more */
+#define ARGON2_PROBE1(name, instance, a5)                                      \
+    DTRACE_PROBE6(argon2, name, (instance)->memory_blocks,                     \
+                  (instance)->passes, (instance)->lanes, (instance)->type,     \
+                  (instance)->start_ns, a5)
+#define ARGON2_PROBE2(name, instance, a5, a6)                                  \
+    DTRACE_PROBE7(argon2, name, (instance)->memory_blocks,                     \
+                  (instance)->passes, (instance)->lanes, (instance)->type,     \
+                  (instance)->start_ns, a5, a6)
+
+#else
+
+#define ARGON2_PROBE(name, instance) ((void)0)
+#define ARGON2_PROBE1(name, instance, a5) ((void)0)
+#define ARGON2_PROBE2(name, instance, a5, a6) ((void)0)
+
+#endif
+
+#endif
@@ -26,75 +26,107 @@
 #include "blake2/blake2-impl.h"
 #include "blake2/blake2.h"
 
+/* Resolves and prefetches the reference block of the following block */
+static void resolve_next_ref(argon2_next_ref_t *next_ref, uint64_t pseudo_rand) {
+    next_ref->ref_block =
+        reference_block(next_ref->instance, &next_ref->position, pseudo_rand);
+    ARGON2_PREFETCH_BLOCK(next_ref->ref_block);
+}
 
 /*
  * Function fills a new memory block and optionally XORs the old block over the new one.
- * @next_block must be initialized.
- * @param prev_block Pointer to the previous block
+ * Like the SIMD kernels, it keeps the previous block in @state across calls.
+ * The R = state ^ ref_block temporary is parked in @next_block itself, which
+ * is about to be overwritten anyway, so every block is read and written in
+ * two fused passes and no scratch block is needed.
+ * @param state The just produced block. Content will be updated(!)
  * @param ref_block Pointer to the reference block
- * @param next_block Pointer to the block to be constructed
+ * @param next_block Pointer to the block to be constructed. May coincide with
+ * @ref_block
  * @param with_xor Whether to XOR into the new block (1) or just overwrite (0)
+ * @param next_ref If not NULL, the reference block of the following block is
+ * resolved from the first word of @next_block and prefetched before the rest
+ * of @next_block is stored
  * @pre all block pointers must be valid
  */
-static void fill_block(const block *prev_block, const block *ref_block,
-                       block *next_block, int with_xor) {
-    block blockR, block_tmp;
+static void fill_block(block *state, const block *ref_block,
+                       block *next_block, int with_xor,
+                       argon2_next_ref_t *next_ref) {
+    uint64_t *v = state->v;
     unsigned i;
 
-    copy_block(&blockR, ref_block);
-    xor_block(&blockR, prev_block);
-    copy_block(&block_tmp, &blockR);
-    /* Now blockR = ref_block + prev_block and block_tmp = ref_block + prev_block */
     if (with_xor) {
-        /* Saving the next block contents for XOR over: */
-        xor_block(&block_tmp, next_block);
-        /* Now blockR = ref_block + prev_block and
-           block_tmp = ref_block + prev_block + next_block */
+        for (i = 0; i < ARGON2_QWORDS_IN_BLOCK; ++i) {
+            v[i] ^= ref_block->v[i];
+            next_block->v[i] ^= v[i];
+        }
+    } else {
+        for (i = 0; i < ARGON2_QWORDS_IN_BLOCK; ++i) {
+            v[i] ^= ref_block->v[i];
+            next_block->v[i] = v[i];
+        }
     }
 
     /* Apply Blake2 on columns of 64-bit words: (0,1,...,15) , then
        (16,17,..31)... finally (112,113,...127) */
     for (i = 0; i < 8; ++i) {
         BLAKE2_ROUND_NOMSG(
-            blockR.v[16 * i], blockR.v[16 * i + 1], blockR.v[16 * i + 2],
-            blockR.v[16 * i + 3], blockR.v[16 * i + 4], blockR.v[16 * i + 5],
-            blockR.v[16 * i + 6], blockR.v[16 * i + 7], blockR.v[16 * i + 8],
-            blockR.v[16 * i + 9], blockR.v[16 * i + 10], blockR.v[16 * i + 11],
-            blockR.v[16 * i + 12], blockR.v[16 * i + 13], blockR.v[16 * i + 14],
-            blockR.v[16 * i + 15]);
+            v[16 * i], v[16 * i + 1], v[16 * i + 2], v[16 * i + 3],
+            v[16 * i + 4], v[16 * i + 5], v[16 * i + 6], v[16 * i + 7],
+            v[16 * i + 8], v[16 * i + 9], v[16 * i + 10], v[16 * i + 11],
+            v[16 * i + 12], v[16 * i + 13], v[16 * i + 14], v[16 * i + 15]);
     }
 
     /* Apply Blake2 on rows of 64-bit words: (0,1,16,17,...112,113), then
        (2,3,18,19,...,114,115).. finally (14,15,30,31,...,126,127) */
     for (i = 0; i < 8; i++) {
         BLAKE2_ROUND_NOMSG(
-            blockR.v[2 * i], blockR.v[2 * i + 1], blockR.v[2 * i + 16],
-            blockR.v[2 * i + 17], blockR.v[2 * i + 32], blockR.v[2 * i + 33],
-            blockR.v[2 * i + 48], blockR.v[2 * i + 49], blockR.v[2 * i + 64],
-            blockR.v[2 * i + 65], blockR.v[2 * i + 80], blockR.v[2 * i + 81],
-            blockR.v[2 * i + 96], blockR.v[2 * i + 97], blockR.v[2 * i + 112],
-            blockR.v[2 * i + 113]);
+            v[2 * i], v[2 * i + 1], v[2 * i + 16], v[2 * i + 17],
+            v[2 * i + 32], v[2 * i + 33], v[2 * i + 48], v[2 * i + 49],
+            v[2 * i + 64], v[2 * i + 65], v[2 * i + 80], v[2 * i + 81],
+            v[2 * i + 96], v[2 * i + 97], v[2 * i + 112], v[2 * i + 113]);
+    }
+
+    /* XOR with the parked R (and old block) and store; the first word
+     * decides the next reference block, so it goes first */
+    v[0] ^= next_block->v[0];
+    next_block->v[0] = v[0];
+    if (next_ref != NULL) {
+        resolve_next_ref(next_ref, v[0]);
     }
 
-    copy_block(next_block, &block_tmp);
-    xor_block(next_block, &blockR);
+    for (i = 1; i < ARGON2_QWORDS_IN_BLOCK; ++i) {
+        v[i] ^= next_block->v[i];
+        next_block->v[i] = v[i];
+    }
 }
 
-static void next_addresses(block *address_block, block *input_block,
-                           const block *zero_block) {
+static void next_addresses(block *address_block, block *input_block) {
+    block zero_block, zero2_block;
+
+    init_block_value(&zero_block, 0);
+    init_block_value(&zero2_block, 0);
+
+    /*Increasing index counter*/
     input_block->v[6]++;
-    fill_block(zero_block, input_block, address_block, 0);
-    fill_block(zero_block, address_block, address_block, 0);
+
+    /*First iteration of G*/
+    fill_block(&zero_block, input_block, address_block, 0, NULL);
+
+    /*Second iteration of G*/
+    fill_block(&zero2_block, address_block, address_block, 0, NULL);
 }
 
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position) {
     block *ref_block = NULL, *curr_block = NULL;
-    block address_block, input_block, zero_block;
-    uint64_t pseudo_rand, ref_index, ref_lane;
+    block address_block, input_block;
+    block *ref_blocks[ARGON2_ADDRESSES_IN_BLOCK];
+    argon2_next_ref_t next_ref;
+    uint64_t pseudo_rand;
     uint32_t prev_offset, curr_offset;
-    uint32_t starting_index;
-    uint32_t i;
+    uint32_t starting_index, i, address, addresses_end = 0;
+    block state;
     int data_independent_addressing;
 
     if (instance == NULL) {
@@ -107,7 +139,6 @@ void fill_segment(const argon2_instance_t *instance,
          (position.slice < ARGON2_SYNC_POINTS / 2));
 
     if (data_independent_addressing) {
-        init_block_value(&zero_block, 0);
         init_block_value(&input_block, 0);
 
         input_block.v[0] = position.pass;
@@ -125,7 +156,7 @@ void fill_segment(const argon2_instance_t *instance,
 
         /* Don't forget to generate the first block of addresses: */
         if (data_independent_addressing) {
-            next_addresses(&address_block, &input_block, &zero_block);
+            next_addresses(&address_block, &input_block);
         }
     }
 
@@ -141,6 +172,12 @@ void fill_segment(const argon2_instance_t *instance,
         prev_offset = curr_offset - 1;
     }
 
+    copy_block(&state, instance->memory + prev_offset);
+
+    next_ref.instance = instance;
+    next_ref.position = position;
+    next_ref.ref_block = NULL;
+
     for (i = starting_index; i < instance->segment_length;
          ++i, ++curr_offset, ++prev_offset) {
         /*1.1 Rotating prev_offset if needed */
@@ -148,47 +185,45 @@ void fill_segment(const argon2_instance_t *instance,
             prev_offset = curr_offset - 1;
         }
 
-        /* 1.2 Computing the index of the reference block */
-        /* 1.2.1 Taking pseudo-random value from the previous block */
+        /* 1.2 Computing the reference block */
+        position.index = i;
         if (data_independent_addressing) {
-            if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) {
-                next_addresses(&address_block, &input_block, &zero_block);
+            address = i % ARGON2_ADDRESSES_IN_BLOCK;
+            if (address == 0) {
+                next_addresses(&address_block, &input_block);
+            }
+            if (address == 0 || i == starting_index) {
+                /* Map the whole (rest of the) address block at once */
+                position.index = i - address;
+                addresses_end = instance->segment_length - position.index;
+                if (addresses_end > ARGON2_ADDRESSES_IN_BLOCK) {
+                    addresses_end = ARGON2_ADDRESSES_IN_BLOCK;
+                }
+                index_alpha_block(instance, &position, &address_block,
+                                  address, addresses_end - address,
+                                  ref_blocks);
+                position.index = i;
             }
-            pseudo_rand = address_block.v[i % ARGON2_ADDRESSES_IN_BLOCK];
+            ref_block = ref_blocks[address];
+            if (address + 1 < addresses_end) {
+                ARGON2_PREFETCH_BLOCK(ref_blocks[address + 1]);
+            }
+        } else if (next_ref.ref_block != NULL) {
+            /* Already resolved while the previous block was stored */
+            ref_block = next_ref.ref_block;
         } else {
             pseudo_rand = instance->memory[prev_offset].v[0];
+            ref_block = reference_block(instance, &position, pseudo_rand);
         }
 
-        /* 1.2.2 Computing the lane of the reference block */
-        ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
-
-        if ((position.pass == 0) && (position.slice == 0)) {
-            /* Can not reference other lanes yet */
-            ref_lane = position.lane;
-        }
-
-        /* 1.2.3 Computing the number of possible reference block within the
-         * lane.
-         */
-        position.index = i;
-        ref_index = index_alpha(instance, &position, pseudo_rand & 0xFFFFFFFF,
-                                ref_lane == position.lane);
-
-        /* 2 Creating a new block */
-        ref_block =
-            instance->memory + instance->lane_length * ref_lane + ref_index;
+        /* 2 Creating a new block; in data-dependent mode fill_block() also
+         * resolves the reference block of the next one */
+        next_ref.position.index = i + 1;
         curr_block = instance->memory + curr_offset;
-        if (ARGON2_VERSION_10 == instance->version) {
-            /* version 1.2.1 and earlier: overwrite, not XOR */
-            fill_block(instance->memory + prev_offset, ref_block, curr_block, 0);
-        } else {
-            if(0 == position.pass) {
-                fill_block(instance->memory + prev_offset, ref_block,
-                           curr_block, 0);
-            } else {
-                fill_block(instance->memory + prev_offset, ref_block,
-                           curr_block, 1);
-            }
-        }
+        fill_block(&state, ref_block, curr_block,
+                   /* version 1.2.1 and earlier: overwrite, not XOR */
+                   ARGON2_VERSION_10 != instance->version && 0 != position.pass,
+                   (data_independent_addressing ||
+                    i + 1 == instance->segment_length) ? NULL : &next_ref);
     }
 }
@@ -25,12 +25,15 @@
 
 #include "argon2.h"
 #include "core.h"
+#include "batch.h"
+#include "serve.h"
 
 #define T_COST_DEF 3
 #define LOG_M_COST_DEF 12 /* 2^12 = 4 MiB */
 #define LANES_DEF 1
 #define THREADS_DEF 1
 #define OUTLEN_DEF 32
+#define WORKERS_DEF 4
 #define MAX_PASS_LEN 128
 
 #define UNUSED_PARAMETER(x) (void)(x)
@@ -40,7 +43,20 @@ static void usage(const char *cmd) {
            "[-m log2(memory in KiB) | -k memory in KiB] [-p parallelism] "
            "[-l hash length] [-e|-r] [-v (10|13)]\n",
            cmd);
+    printf("        %s --serve socket [-i|-d|-id] [-t iterations] "
+           "[-m log2(memory in KiB) | -k memory in KiB] [-p parallelism] "
+           "[-l hash length] [-v (10|13)] [-w workers]\n",
+           cmd);
+    printf("        %s -batch [-0] [-i|-d|-id] [-t iterations] "
+           "[-m log2(memory in KiB) | -k memory in KiB] [-p parallelism] "
+           "[-l hash length] [-v (10|13)] [-w workers]\n",
+           cmd);
     printf("\tPassword is read from stdin\n");
+    printf("\tWith --serve, hash and verify requests are read from a Unix "
+           "socket (see src/serve.h)\n");
+    printf("\tWith -batch, password TAB salt [TAB m=N,t=N,p=N] records are "
+           "read from stdin\n\tand their encoded hashes written in order "
+           "(see src/batch.h)\n");
     printf("Parameters:\n");
     printf("\tsalt\t\tThe salt to use, at least 8 characters\n");
     printf("\t-i\t\tUse Argon2i (this is the default)\n");
@@ -60,6 +76,12 @@ static void usage(const char *cmd) {
     printf("\t-r\t\tOutput only the raw bytes of the hash\n");
     printf("\t-v (10|13)\tArgon2 version (defaults to the most recent version, currently %x)\n",
             ARGON2_VERSION_NUMBER);
+    printf("\t-w N\t\tWith --serve, serves N connections at once "
+           "(default %d);\n\t\t\twith -batch, hashes N records at once "
+           "(default one per CPU)\n",
+           WORKERS_DEF);
+    printf("\t-0\t\tWith -batch, records end with a NUL byte instead of a "
+           "newline\n");
     printf("\t-h\t\tPrint %s usage\n", cmd);
 }
 
@@ -179,9 +201,13 @@ int main(int argc, char *argv[]) {
     int encoded_only = 0;
     int raw_only = 0;
     uint32_t version = ARGON2_VERSION_NUMBER;
+    uint32_t workers = 0;
+    int batch_mode = 0;
+    int delimiter = '\n';
     int i;
-    size_t pwdlen;
+    size_t pwdlen = 0;
     char pwd[MAX_PASS_LEN], *salt;
+    const char *socket_path = NULL;
 
     if (argc < 2) {
         usage(argv[0]);
@@ -191,19 +217,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    /* get password from stdin */
-    pwdlen = fread(pwd, 1, sizeof pwd, stdin);
-    if(pwdlen < 1) {
-        fatal("no password read");
-    }
-    if(pwdlen == MAX_PASS_LEN) {
-        fatal("Provided password longer than supported in command line utility");
-    }
+    if (strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            fatal("missing --serve socket path");
+        }
+        socket_path = argv[2];
+        salt = NULL;
+    } else if (strcmp(argv[1], "-batch") == 0) {
+        batch_mode = 1;
+        salt = NULL;
+    } else {
+        /* get password from stdin */
+        pwdlen = fread(pwd, 1, sizeof pwd, stdin);
+        if(pwdlen < 1) {
+            fatal("no password read");
+        }
+        if(pwdlen == MAX_PASS_LEN) {
+            fatal("Provided password longer than supported in command line utility");
+        }
 
-    salt = argv[1];
+        salt = argv[1];
+    }
 
     /* parse options */
-    for (i = 2; i < argc; i++) {
+    for (i = socket_path ? 3 : 2; i < argc; i++) {
         const char *a = argv[i];
         unsigned long input = 0;
         if (!strcmp(a, "-h")) {
@@ -284,6 +321,20 @@ int main(int argc, char *argv[]) {
             } else {
                 fatal("missing -l argument");
             }
+        } else if (!strcmp(a, "-w") && (socket_path || batch_mode)) {
+            if (i < argc - 1) {
+                i++;
+                input = strtoul(argv[i], NULL, 10);
+                if (input == 0 || input > 1024) {
+                    fatal("bad numeric input for -w");
+                }
+                workers = input;
+                continue;
+            } else {
+                fatal("missing -w argument");
+            }
+        } else if (!strcmp(a, "-0") && batch_mode) {
+            delimiter = '\0';
         } else if (!strcmp(a, "-i")) {
             type = Argon2_i;
             ++types_specified;
@@ -322,6 +373,34 @@ int main(int argc, char *argv[]) {
     if(encoded_only && raw_only)
         fatal("cannot provide both -e and -r");
 
+    if (socket_path) {
+        serve_params params;
+        params.type = type;
+        params.t_cost = t_cost;
+        params.m_cost = m_cost;
+        params.lanes = lanes;
+        params.threads = threads;
+        params.outlen = outlen;
+        params.version = version;
+        params.workers = workers ? workers : WORKERS_DEF;
+        params.idle_timeout = SERVE_IDLE_TIMEOUT;
+        return serve(socket_path, &params);
+    }
+
+    if (batch_mode) {
+        batch_params params;
+        params.type = type;
+        params.t_cost = t_cost;
+        params.m_cost = m_cost;
+        params.lanes = lanes;
+        params.threads = threads;
+        params.outlen = outlen;
+        params.version = version;
+        params.workers = workers;
+        params.delimiter = delimiter;
+        return batch(&params);
+    }
+
     if(!encoded_only && !raw_only) {
         printf("Type:\t\t%s\n", argon2_type2string(type, 1));
         printf("Iterations:\t%u\n", t_cost);
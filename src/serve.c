@@ -0,0 +1,626 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serve.h"
+
+#if defined(_WIN32) || defined(ARGON2_NO_THREADS)
+
+int serve(const char *path, const serve_params *params) {
+    (void)path;
+    (void)params;
+    fprintf(stderr, "Error: --serve is not supported in this build\n");
+    return 1;
+}
+
+int serve_fd(int fd, const serve_params *params) {
+    (void)fd;
+    (void)params;
+    return 1;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "encoding.h"
+
+/* Connections accepted but not yet picked up by a worker */
+#define SERVE_QUEUE 64
+
+/* Latency samples kept per request type for the percentiles */
+#define SERVE_SAMPLES 4096
+
+#define SERVE_OP_HASH 0
+#define SERVE_OP_VERIFY 1
+#define SERVE_OP_STATS 2
+#define SERVE_OPS 3
+
+static const char *const serve_op_names[SERVE_OPS] = {"hash", "verify",
+                                                      "stats"};
+
+typedef struct Serve_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t samples[SERVE_SAMPLES]; /* ring of the last latencies */
+} serve_op_stats;
+
+typedef struct Serve_worker {
+    pthread_t thread;
+    argon2_session *session;
+    int fd; /* connection being served, -1 if idle */
+    uint8_t *out;
+    uint8_t *resp;     /* response header, followed by... */
+    char *encoded;     /* ...the encoded hash or the report */
+    size_t encoded_len;
+    struct Serve_server *server;
+} serve_worker;
+
+typedef struct Serve_server {
+    const serve_params *params;
+    pthread_mutex_t lock; /* guards everything below */
+    pthread_cond_t queued;
+    int queue[SERVE_QUEUE];
+    uint32_t queue_head, queue_len;
+    int stopping;
+    uint32_t busy;
+    serve_op_stats stats[SERVE_OPS];
+    uint64_t sorted[SERVE_SAMPLES]; /* report() scratch */
+    serve_worker *workers;
+} serve_server;
+
+/* Written to by the signal handler to wake up the accept loop */
+static int serve_wake_fd = -1;
+
+static void serve_on_signal(int sig) {
+    const int saved = errno;
+    char c = (char)sig;
+    if (write(serve_wake_fd, &c, 1) < 0) {
+        /* the pipe is full, so the loop is already woken up */
+    }
+    errno = saved;
+}
+
+static uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* @return 1 after reading @len bytes, 0 on EOF or error */
+static int read_full(int fd, uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static void record(serve_server *server, int op, int result,
+                   uint64_t elapsed_ns) {
+    serve_op_stats *stats = &server->stats[op];
+
+    pthread_mutex_lock(&server->lock);
+    stats->samples[stats->count % SERVE_SAMPLES] = elapsed_ns;
+    stats->count++;
+    stats->total_ns += elapsed_ns;
+    if (elapsed_ns > stats->max_ns) {
+        stats->max_ns = elapsed_ns;
+    }
+    if (result != ARGON2_OK && result != ARGON2_VERIFY_MISMATCH) {
+        stats->errors++;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Writes the statistics as text, one line per request type: counts since
+ * startup, mean and maximum since startup, and the percentiles of the last
+ * SERVE_SAMPLES requests; latencies are in microseconds
+ * @return Length of the report
+ */
+static size_t report(serve_server *server, char *dst, size_t dst_len) {
+    uint64_t *sorted = server->sorted;
+    size_t len = 0;
+    int op;
+
+    pthread_mutex_lock(&server->lock);
+    len += (size_t)snprintf(dst + len, dst_len - len,
+                            "workers %u busy %u queued %u\n",
+                            server->params->workers, server->busy,
+                            server->queue_len);
+    for (op = 0; op < SERVE_OPS && len < dst_len; ++op) {
+        const serve_op_stats *stats = &server->stats[op];
+        const size_t n = (size_t)ARGON2_MIN(stats->count, SERVE_SAMPLES);
+        uint64_t p50 = 0, p99 = 0, mean = 0;
+
+        if (n > 0) {
+            memcpy(sorted, stats->samples, n * sizeof(sorted[0]));
+            qsort(sorted, n, sizeof(sorted[0]), compare_u64);
+            p50 = sorted[(n - 1) / 2];
+            p99 = sorted[(n - 1) * 99 / 100];
+            mean = stats->total_ns / stats->count;
+        }
+        len += (size_t)snprintf(
+            dst + len, dst_len - len,
+            "%s count %lu errors %lu mean_us %lu p50_us %lu p99_us %lu "
+            "max_us %lu\n",
+            serve_op_names[op], (unsigned long)stats->count,
+            (unsigned long)stats->errors, (unsigned long)(mean / 1000),
+            (unsigned long)(p50 / 1000), (unsigned long)(p99 / 1000),
+            (unsigned long)(stats->max_ns / 1000));
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return ARGON2_MIN(len, dst_len - 1);
+}
+
+static int handle_hash(serve_worker *worker, const uint8_t *req,
+                       uint32_t len, size_t *payload_len) {
+    const serve_params *params = worker->server->params;
+    argon2_context context;
+    uint32_t saltlen;
+    int result;
+
+    if (len < 4 || (saltlen = load_be32(req)) > len - 4) {
+        return ARGON2_DECODING_FAIL;
+    }
+
+    memset(&context, 0, sizeof(context));
+    context.out = worker->out;
+    context.outlen = params->outlen;
+    context.salt = (uint8_t *)req + 4;
+    context.saltlen = saltlen;
+    context.pwd = (uint8_t *)req + 4 + saltlen;
+    context.pwdlen = len - 4 - saltlen;
+    context.t_cost = params->t_cost;
+    context.m_cost = params->m_cost;
+    context.lanes = params->lanes;
+    context.threads = params->threads;
+    context.version = params->version;
+    context.flags = ARGON2_DEFAULT_FLAGS;
+
+    result = argon2_session_ctx(worker->session, &context, params->type);
+    if (result == ARGON2_OK) {
+        result = encode_string(worker->encoded, worker->encoded_len, &context,
+                               params->type);
+    }
+    clear_internal_memory(worker->out, params->outlen);
+    if (result == ARGON2_OK) {
+        *payload_len = strlen(worker->encoded);
+    }
+    return result;
+}
+
+static int handle_verify(serve_worker *worker, const uint8_t *req,
+                         uint32_t len) {
+    char encoded[SERVE_MAX_FRAME];
+    uint32_t enclen;
+    int result;
+
+    if (len < 4 || (enclen = load_be32(req)) > len - 4) {
+        return ARGON2_DECODING_FAIL;
+    }
+    memcpy(encoded, req + 4, enclen);
+    encoded[enclen] = '\0';
+
+    result = argon2_session_verify(worker->session, encoded, req + 4 + enclen,
+                                   len - 4 - enclen,
+                                   worker->server->params->type);
+    clear_internal_memory(encoded, enclen);
+    return result;
+}
+
+/*
+ * Serves requests on @fd until the client hangs up, breaks the protocol or
+ * leaves a read pending for longer than the idle timeout
+ */
+static void serve_connection(serve_worker *worker, int fd) {
+    const uint32_t idle_timeout = worker->server->params->idle_timeout;
+    uint8_t req[SERVE_MAX_FRAME];
+    uint8_t *resp = worker->resp;
+
+    if (idle_timeout > 0) {
+        struct timeval tv;
+        tv.tv_sec = (time_t)idle_timeout;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    for (;;) {
+        uint8_t header[4];
+        uint32_t len;
+        uint64_t start;
+        size_t payload_len = 0;
+        int op, result;
+
+        if (!read_full(fd, header, 4)) {
+            break;
+        }
+        len = load_be32(header);
+        if (len == 0 || len > SERVE_MAX_FRAME || !read_full(fd, req, len)) {
+            break;
+        }
+
+        start = argon2_monotonic_ns();
+        switch (req[0]) {
+        case 'H':
+            op = SERVE_OP_HASH;
+            result = handle_hash(worker, req + 1, len - 1, &payload_len);
+            break;
+        case 'V':
+            op = SERVE_OP_VERIFY;
+            result = handle_verify(worker, req + 1, len - 1);
+            break;
+        case 'S':
+            op = SERVE_OP_STATS;
+            payload_len = report(worker->server, worker->encoded,
+                                 worker->encoded_len);
+            result = ARGON2_OK;
+            break;
+        default:
+            op = -1;
+            result = ARGON2_DECODING_FAIL;
+            break;
+        }
+        clear_internal_memory(req, len);
+        if (op >= 0) {
+            record(worker->server, op, result,
+                   argon2_monotonic_ns() - start);
+        }
+
+        store_be32(resp, (uint32_t)(4 + payload_len));
+        store_be32(resp + 4, (uint32_t)result);
+        if (!write_full(fd, resp, 8 + payload_len)) {
+            break;
+        }
+    }
+}
+
+static void *serve_worker_main(void *arg) {
+    serve_worker *worker = (serve_worker *)arg;
+    serve_server *server = worker->server;
+
+    for (;;) {
+        int fd;
+
+        pthread_mutex_lock(&server->lock);
+        while (server->queue_len == 0 && !server->stopping) {
+            pthread_cond_wait(&server->queued, &server->lock);
+        }
+        if (server->queue_len == 0) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVE_QUEUE;
+        server->queue_len--;
+        server->busy++;
+        worker->fd = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        serve_connection(worker, fd);
+
+        pthread_mutex_lock(&server->lock);
+        worker->fd = -1;
+        server->busy--;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Creates the worker's session and runs one hash in it, so that the first
+ * client does not pay for mapping and faulting in the memory blocks
+ */
+static int warm_up(serve_worker *worker) {
+    const serve_params *params = worker->server->params;
+    const size_t max_encoded = argon2_encodedlen(
+        params->t_cost, params->m_cost, params->lanes, SERVE_MAX_FRAME,
+        params->outlen, params->type);
+    uint8_t salt[ARGON2_MIN_SALT_LENGTH] = {0};
+    argon2_context context;
+
+    worker->fd = -1;
+    worker->session = argon2_session_create(0);
+    worker->out = (uint8_t *)malloc(params->outlen);
+    worker->encoded_len =
+        max_encoded > SERVE_MAX_FRAME ? max_encoded : SERVE_MAX_FRAME;
+    worker->resp = (uint8_t *)malloc(8 + worker->encoded_len);
+    if (!worker->session || !worker->out || !worker->resp) {
+        return ARGON2_MEMORY_ALLOCATION_ERROR;
+    }
+    worker->encoded = (char *)worker->resp + 8;
+
+    memset(&context, 0, sizeof(context));
+    context.out = worker->out;
+    context.outlen = params->outlen;
+    context.salt = salt;
+    context.saltlen = sizeof(salt);
+    context.t_cost = 1;
+    context.m_cost = params->m_cost;
+    context.lanes = params->lanes;
+    context.threads = params->threads;
+    context.version = params->version;
+    context.flags = ARGON2_DEFAULT_FLAGS;
+    return argon2_session_ctx(worker->session, &context, params->type);
+}
+
+static void release_worker(serve_worker *worker) {
+    if (worker->session) {
+        argon2_session_release(worker->session);
+    }
+    free(worker->out);
+    free(worker->resp);
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd, bound;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    /* Replace the socket of a previous run, but never any other file */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    /* Owner only: anyone who can connect can use us as a verify oracle */
+    mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, SERVE_QUEUE) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_fd(int fd, const serve_params *params) {
+    serve_server server;
+    serve_worker worker;
+    int result;
+
+    memset(&server, 0, sizeof(server));
+    memset(&worker, 0, sizeof(worker));
+    server.params = params;
+    server.workers = &worker;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued, NULL);
+    worker.server = &server;
+
+    result = warm_up(&worker);
+    if (result == ARGON2_OK) {
+        serve_connection(&worker, fd);
+    } else {
+        fprintf(stderr, "Error: %s\n", argon2_error_message(result));
+    }
+
+    release_worker(&worker);
+    pthread_cond_destroy(&server.queued);
+    pthread_mutex_destroy(&server.lock);
+    return result == ARGON2_OK ? 0 : 1;
+}
+
+int serve(const char *path, const serve_params *params) {
+    serve_server server;
+    struct sigaction sa;
+    int wake[2];
+    int listen_fd;
+    uint32_t started = 0, i;
+    int result = 0;
+
+    memset(&server, 0, sizeof(server));
+    server.params = params;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued, NULL);
+
+    server.workers =
+        (serve_worker *)calloc(params->workers, sizeof(serve_worker));
+    if (!server.workers) {
+        fprintf(stderr, "Error: %s\n",
+                argon2_error_message(ARGON2_MEMORY_ALLOCATION_ERROR));
+        return 1;
+    }
+    for (i = 0; i < params->workers; ++i) {
+        int warmed;
+        server.workers[i].server = &server;
+        warmed = warm_up(&server.workers[i]);
+        if (warmed != ARGON2_OK) {
+            fprintf(stderr, "Error: %s\n", argon2_error_message(warmed));
+            result = 1;
+            goto release;
+        }
+    }
+
+    if (pipe(wake) < 0) {
+        perror("pipe");
+        result = 1;
+        goto release;
+    }
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    serve_wake_fd = wake[1];
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    listen_fd = listen_on(path);
+    if (listen_fd < 0) {
+        result = 1;
+        goto close_pipe;
+    }
+
+    for (started = 0; started < params->workers; ++started) {
+        if (pthread_create(&server.workers[started].thread, NULL,
+                           serve_worker_main, &server.workers[started])) {
+            fprintf(stderr, "Error: %s\n",
+                    argon2_error_message(ARGON2_THREAD_FAIL));
+            result = 1;
+            break;
+        }
+    }
+
+    fprintf(stderr, "Serving on %s with %u workers\n", path, started);
+    while (result == 0) {
+        struct pollfd fds[2];
+        int fd;
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&server.lock);
+        if (server.queue_len == SERVE_QUEUE) {
+            pthread_mutex_unlock(&server.lock);
+            close(fd); /* overloaded: let the client retry */
+            continue;
+        }
+        server.queue[(server.queue_head + server.queue_len) % SERVE_QUEUE] = fd;
+        server.queue_len++;
+        pthread_cond_signal(&server.queued);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    /*
+     * Stop accepting, drop the connections nobody picked up, and hang up on
+     * the open ones once their current request is answered
+     */
+    close(listen_fd);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    for (; server.queue_len > 0; server.queue_len--) {
+        close(server.queue[server.queue_head]);
+        server.queue_head = (server.queue_head + 1) % SERVE_QUEUE;
+    }
+    for (i = 0; i < started; ++i) {
+        if (server.workers[i].fd >= 0) {
+            shutdown(server.workers[i].fd, SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&server.queued);
+    pthread_mutex_unlock(&server.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(server.workers[i].thread, NULL);
+    }
+
+close_pipe:
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    close(wake[0]);
+    close(wake[1]);
+release:
+    for (i = 0; i < params->workers; ++i) {
+        release_worker(&server.workers[i]);
+    }
+    free(server.workers);
+    pthread_cond_destroy(&server.queued);
+    pthread_mutex_destroy(&server.lock);
+    return result;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef ARGON2_SERVE_H
+#define ARGON2_SERVE_H
+
+#include <stdint.h>
+
+#include "argon2.h"
+
+/*
+ * Daemon mode of the argon2 utility (argon2 --serve path). Every frame, in
+ * both directions, is a 4-byte big-endian length followed by that many
+ * bytes. A request starts with an opcode:
+ *
+ *   'H' salt length (4 bytes, big endian), salt, password
+ *       Hashes with the parameters the server was started with
+ *   'V' encoded hash length (4 bytes, big endian), encoded hash, password
+ *       Verifies against an encoded hash of the server's Argon2 type
+ *   'S' Reports request counts and latencies as text
+ *
+ * A response starts with the Argon2 status code (4 bytes, big endian, two's
+ * complement), followed by the encoded hash for 'H' and the report for 'S'.
+ * A connection carries any number of requests; the server hangs up on one
+ * that sends nothing for idle_timeout seconds.
+ */
+
+#define SERVE_MAX_FRAME 4096
+
+/* Default idle_timeout of the argon2 utility, in seconds */
+#define SERVE_IDLE_TIMEOUT 60
+
+/* Parameters of the hashes a server produces */
+typedef struct Serve_params {
+    argon2_type type;
+    uint32_t t_cost;
+    uint32_t m_cost;
+    uint32_t lanes;
+    uint32_t threads;
+    uint32_t outlen;
+    uint32_t version;
+    uint32_t workers; /* connections served at once, each with a session */
+    uint32_t idle_timeout; /* seconds a connection may idle, 0: no limit */
+} serve_params;
+
+/*
+ * Listens on the Unix socket @path (replacing a stale socket, but no other
+ * kind of file) and serves requests until SIGINT or SIGTERM. The socket is
+ * created with mode 0600, so only the owner (and root) can connect; loosen
+ * it with chmod, or put it in a directory that is private to the clients.
+ * @return 0 after a clean shutdown, 1 if the server could not start
+ */
+int serve(const char *path, const serve_params *params);
+
+/*
+ * Serves the requests of the already connected socket @fd with a single
+ * worker, as serve() does for each client, until the client hangs up, breaks
+ * the protocol or times out. Does not close @fd.
+ * @return 0 once the connection is done, 1 if the worker could not start
+ */
+int serve_fd(int fd, const serve_params *params);
+
+#endif
@@ -24,6 +24,18 @@
 
 #include "argon2.h"
 
+#if !defined(_WIN32) && !defined(ARGON2_NO_THREADS)
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "core.h"
+#include "serve.h"
+#define TEST_SERVE
+#define TEST_THREADS
+#endif
+
 #define OUT_LEN 32
 #define ENCODED_LEN 108
 
@@ -64,6 +76,220 @@ void hashtest(uint32_t version, uint32_t t, uint32_t m, uint32_t p, char *pwd,
     printf("PASS\n");
 }
 
+/* Collects a streamed tag into a buffer, checking the chunk size bound */
+typedef struct stream_sink {
+    unsigned char *buf;
+    size_t len;
+    size_t max_chunks; /* abort after this many chunks, 0 = never */
+    size_t chunks;
+} stream_sink;
+
+static int stream_collect(const uint8_t *chunk, size_t chunklen, void *arg) {
+    stream_sink *sink = arg;
+    assert(chunklen > 0 && chunklen <= 64);
+    if (sink->max_chunks && sink->chunks == sink->max_chunks) {
+        return -1;
+    }
+    memcpy(sink->buf + sink->len, chunk, chunklen);
+    sink->len += chunklen;
+    sink->chunks++;
+    return 0;
+}
+
+/*
+ * Sets up @context for password "password" and salt "somesalt" with
+ * t_cost 2, m_cost 256 KiB and @lanes lanes and threads, writing an
+ * @outlen-byte tag to @out
+ */
+static void init_context(argon2_context *context, unsigned char *out,
+                         uint32_t outlen, uint32_t lanes) {
+    memset(context, 0, sizeof(*context));
+    context->out = out;
+    context->outlen = outlen;
+    context->pwd = (uint8_t *)"password";
+    context->pwdlen = (uint32_t)strlen("password");
+    context->salt = (uint8_t *)"somesalt";
+    context->saltlen = (uint32_t)strlen("somesalt");
+    context->t_cost = 2;
+    context->m_cost = 1 << 8;
+    context->lanes = lanes;
+    context->threads = lanes;
+    context->version = ARGON2_VERSION_NUMBER;
+}
+
+static void streamtest(uint32_t outlen) {
+    unsigned char *expected = malloc(outlen);
+    unsigned char *streamed = malloc(outlen);
+    stream_sink sink;
+    argon2_context context;
+    int ret;
+
+    printf("Stream test: outlen=%u: ", outlen);
+    assert(expected && streamed);
+
+    init_context(&context, expected, outlen, 2);
+    ret = argon2_ctx(&context, Argon2_id);
+    assert(ret == ARGON2_OK);
+
+    memset(&sink, 0, sizeof(sink));
+    sink.buf = streamed;
+    context.out = NULL;
+    ret = argon2_ctx_stream(&context, Argon2_id, stream_collect, &sink);
+    assert(ret == ARGON2_OK);
+    assert(sink.len == outlen);
+    assert(memcmp(expected, streamed, outlen) == 0);
+
+    free(expected);
+    free(streamed);
+    printf("PASS\n");
+}
+
+#ifdef TEST_THREADS
+/* Takes the calling thread's cached arena and exits without giving it back */
+static void *cache_take(void *arg) {
+    argon2_arena **owner = arg;
+    uint8_t *base = arena_cache_get(4096, owner);
+    assert(base != NULL);
+    return NULL;
+}
+
+/* Starts a hash on a thread that exits before it is finished */
+static void *begin_thread(void *arg) {
+    argon2_context *context = arg;
+    argon2_state *state;
+    int ret = argon2_begin(context, Argon2_id, &state);
+    assert(ret == ARGON2_OK);
+    assert(argon2_step(state, 1) == 1);
+    return state;
+}
+#endif
+
+#ifdef TEST_THREADS
+/* Runs the hash of the context at @arg, returning its result code */
+static void *ctx_thread(void *arg) {
+    return (void *)(intptr_t)argon2_ctx((argon2_context *)arg, Argon2_id);
+}
+
+/* Waits up to ten seconds for @queued segments to wait for a slot */
+static void wait_queued(uint32_t queued) {
+    uint64_t until = argon2_monotonic_ns() + UINT64_C(10000000000);
+    argon2_metrics metrics;
+
+    do {
+        argon2_metrics_snapshot(&metrics);
+    } while (metrics.queued_segments != queued &&
+             argon2_monotonic_ns() < until);
+    assert(metrics.queued_segments == queued);
+}
+#endif
+
+#ifdef TEST_SERVE
+static void store_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Sends an @op request carrying the length of @a, @a and @b (if not NULL) */
+static void serve_send(int fd, char op, const char *a, uint32_t alen,
+                       const char *b) {
+    unsigned char frame[512];
+    uint32_t len = 1;
+
+    frame[4] = (unsigned char)op;
+    if (a != NULL) {
+        store_be32(frame + 5, alen);
+        memcpy(frame + 9, a, strlen(a));
+        memcpy(frame + 9 + strlen(a), b, strlen(b));
+        len += 4 + (uint32_t)(strlen(a) + strlen(b));
+    }
+    store_be32(frame, len);
+    assert(write(fd, frame, 4 + len) == (ssize_t)(4 + len));
+}
+
+/*
+ * Reads a response into @payload and NUL-terminates it
+ * @return The status code, or 1 if the server hung up
+ */
+static int serve_recv(int fd, char *payload) {
+    unsigned char header[8];
+    uint32_t len;
+
+    if (read(fd, header, 8) != 8) {
+        return 1;
+    }
+    len = load_be32(header) - 4;
+    assert(len < 512);
+    assert(read(fd, payload, len) == (ssize_t)len);
+    payload[len] = '\0';
+    return (int)load_be32(header + 4);
+}
+
+static void servetest(void) {
+    serve_params params;
+    char encoded[ENCODED_LEN];
+    char payload[512];
+    int fds[2];
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    params.type = Argon2_id;
+    params.t_cost = 2;
+    params.m_cost = 64;
+    params.lanes = 1;
+    params.threads = 1;
+    params.outlen = OUT_LEN;
+    params.version = ARGON2_VERSION_NUMBER;
+    params.workers = 1;
+    ret = argon2id_hash_encoded(2, 64, 1, "password", 8, "somesalt", 8,
+                                OUT_LEN, encoded, sizeof(encoded));
+    assert(ret == ARGON2_OK);
+
+    /* The whole conversation is queued up before the server reads it */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    serve_send(fds[0], 'H', "somesalt", 8, "password");
+    serve_send(fds[0], 'V', encoded, (uint32_t)strlen(encoded), "password");
+    serve_send(fds[0], 'V', encoded, (uint32_t)strlen(encoded), "wrong");
+    serve_send(fds[0], 'H', "somesalt", 1000, "password");
+    serve_send(fds[0], 'X', NULL, 0, NULL);
+    serve_send(fds[0], 'S', NULL, 0, NULL);
+    assert(write(fds[0], "\0\0\0\0", 4) == 4); /* empty frame: hang up */
+    serve_send(fds[0], 'S', NULL, 0, NULL);
+    assert(serve_fd(fds[1], &params) == 0);
+    close(fds[1]);
+
+    assert(serve_recv(fds[0], payload) == ARGON2_OK);
+    assert(strcmp(payload, encoded) == 0);
+    assert(serve_recv(fds[0], payload) == ARGON2_OK);
+    assert(serve_recv(fds[0], payload) == ARGON2_VERIFY_MISMATCH);
+    assert(serve_recv(fds[0], payload) == ARGON2_DECODING_FAIL);
+    assert(serve_recv(fds[0], payload) == ARGON2_DECODING_FAIL);
+    assert(serve_recv(fds[0], payload) == ARGON2_OK);
+    assert(strstr(payload, "hash count 2 errors 1 ") != NULL);
+    assert(strstr(payload, "verify count 2 errors 0 ") != NULL);
+    assert(serve_recv(fds[0], payload) == 1);
+    close(fds[0]);
+    printf("Serve hash, verify and stats requests: PASS\n");
+
+    /* A client that goes quiet is dropped after the idle timeout */
+    params.idle_timeout = 1;
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    serve_send(fds[0], 'S', NULL, 0, NULL);
+    assert(serve_fd(fds[1], &params) == 0);
+    close(fds[1]);
+    assert(serve_recv(fds[0], payload) == ARGON2_OK);
+    assert(serve_recv(fds[0], payload) == 1);
+    close(fds[0]);
+    printf("Serve idle timeout: PASS\n");
+}
+#endif
+
 int main() {
     int ret;
     unsigned char out[OUT_LEN];
@@ -285,5 +511,647 @@ int main() {
     assert(ret == ARGON2_SALT_TOO_SHORT);
     printf("Fail on salt too short: PASS\n");
 
+    printf("\n");
+    printf("Streaming output tests\n");
+
+    streamtest(4);
+    streamtest(64);
+    streamtest(65);
+    streamtest(1000);
+
+    {
+        stream_sink sink;
+        argon2_context context;
+        unsigned char buf[256];
+
+        memset(&sink, 0, sizeof(sink));
+        sink.buf = buf;
+        sink.max_chunks = 2;
+        memset(&context, 0, sizeof(context));
+        context.outlen = sizeof(buf);
+        context.salt = (uint8_t *)"somesalt";
+        context.saltlen = (uint32_t)strlen("somesalt");
+        context.t_cost = 1;
+        context.m_cost = 1 << 8;
+        context.lanes = 1;
+        context.threads = 1;
+        context.version = ARGON2_VERSION_NUMBER;
+        ret = argon2_ctx_stream(&context, Argon2_id, stream_collect, &sink);
+        assert(ret == ARGON2_OUTPUT_CALLBACK_FAIL);
+        printf("Abort from the output callback: PASS\n");
+    }
+
+    printf("\n");
+    printf("Parsed hash tests\n");
+
+    {
+        argon2_parsed_hash parsed;
+        char encoded[256];
+        uint8_t longsalt[ARGON2_PARSED_SALT_MAX + 1];
+
+        ret = argon2_hash(1, 1 << 8, 2, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+
+        ret = argon2_parse_encoded(&parsed, encoded, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(parsed.m_cost == 1 << 8 && parsed.t_cost == 1);
+        assert(parsed.lanes == 2 && parsed.hashlen == 32);
+        assert(parsed.saltlen == strlen("somesalt"));
+        printf("Parse an encoded hash: PASS\n");
+
+        ret = argon2_verify_parsed(&parsed, "password", strlen("password"));
+        assert(ret == ARGON2_OK);
+        ret = argon2_verify_parsed(&parsed, "passwore", strlen("passwore"));
+        assert(ret == ARGON2_VERIFY_MISMATCH);
+        printf("Verify against a parsed hash: PASS\n");
+
+        ret = argon2_parse_encoded(&parsed, encoded, Argon2_i);
+        assert(ret == ARGON2_DECODING_FAIL);
+        printf("Reject a parsed hash of the wrong type: PASS\n");
+
+        /* A salt larger than the inline buffer takes the allocating path */
+        memset(longsalt, 0x5a, sizeof(longsalt));
+        ret = argon2_hash(1, 1 << 8, 1, "password", strlen("password"),
+                          longsalt, sizeof(longsalt), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+        ret = argon2_parse_encoded(&parsed, encoded, Argon2_id);
+        assert(ret == ARGON2_DECODING_FAIL);
+        ret = argon2_verify(encoded, "password", strlen("password"),
+                            Argon2_id);
+        assert(ret == ARGON2_OK);
+        printf("Verify a hash too large to parse inline: PASS\n");
+    }
+
+    printf("\n");
+    printf("Base64 codec tests\n");
+
+    {
+        /* Decodes to the whole alphabet, so every character is produced
+           and consumed by the block codec */
+        static const uint8_t alphabet[] =
+            "\x00\x10\x83\x10\x51\x87\x20\x92\x8b\x30\xd3\x8f\x41\x14"
+            "\x93\x51\x55\x97\x61\x96\x9b\x71\xd7\x9f\x82\x18\xa3\x92"
+            "\x59\xa7\xa2\x9a\xab\xb2\xdb\xaf\xc3\x1c\xb3\xd3\x5d\xb7"
+            "\xe3\x9e\xbb\xf3\xdf\xbfsalt";
+        char encoded[256];
+
+        ret = argon2_hash(1, 1 << 8, 1, "password", strlen("password"),
+                          alphabet, sizeof(alphabet) - 1, NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+        assert(strstr(encoded, "$ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrst"
+                               "uvwxyz0123456789+/c2FsdA$") != NULL);
+        printf("Encode a salt covering the alphabet: PASS\n");
+
+        ret = argon2_verify(encoded, "password", strlen("password"),
+                            Argon2_id);
+        assert(ret == ARGON2_OK);
+        printf("Decode a salt covering the alphabet: PASS\n");
+    }
+
+    {
+        argon2_context context, decoded;
+        uint8_t out[32], salt[16], tag[32];
+        char encoded[128], fast[128];
+
+        memset(&context, 0, sizeof(context));
+        context.out = out;
+        context.outlen = sizeof(out);
+        context.pwd = (uint8_t *)"password";
+        context.pwdlen = (uint32_t)strlen("password");
+        context.salt = (uint8_t *)"somesaltsomesalt";
+        context.saltlen = 16;
+        context.t_cost = 1;
+        context.m_cost = 1 << 8;
+        context.lanes = 1;
+        context.threads = 1;
+        context.version = ARGON2_VERSION_NUMBER;
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        ret = argon2_encode_ctx(encoded, sizeof(encoded), &context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        context.flags = ARGON2_FLAG_FAST_ENCODING;
+        ret = argon2_encode_ctx(fast, sizeof(fast), &context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(strcmp(encoded, fast) == 0);
+        ret = argon2_verify(fast, "password", strlen("password"), Argon2_id);
+        assert(ret == ARGON2_OK);
+        printf("Encode a tag with the fast codec: PASS\n");
+
+        memset(&decoded, 0, sizeof(decoded));
+        decoded.salt = salt;
+        decoded.saltlen = sizeof(salt);
+        decoded.out = tag;
+        decoded.outlen = sizeof(tag);
+        decoded.flags = ARGON2_FLAG_FAST_ENCODING;
+        ret = argon2_decode_ctx(&decoded, fast, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(decoded.outlen == sizeof(out) && memcmp(tag, out, 32) == 0);
+        assert(decoded.flags == ARGON2_DEFAULT_FLAGS);
+        printf("Decode a tag with the fast codec: PASS\n");
+    }
+
+    printf("\n");
+    printf("Caller-supplied memory tests\n");
+
+    {
+        argon2_context context;
+        unsigned char expected[32], out[32];
+        uint8_t *memory;
+        size_t required = argon2_memory_required(1 << 8, 2);
+
+        assert(required >= (size_t)(1 << 8) * 1024);
+        assert(argon2_memory_required(1 << 8, 0) == 0);
+
+        init_context(&context, expected, sizeof(expected), 2);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        /* Deliberately misaligned by one byte */
+        memory = malloc(required + 1);
+        assert(memory != NULL);
+        context.out = out;
+        ret = argon2_ctx_with_memory(&context, Argon2_id, memory + 1,
+                                     required);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+        printf("Hash in caller-supplied memory: PASS\n");
+
+        ret = argon2_ctx_with_memory(&context, Argon2_id, memory,
+                                     required - 1);
+        assert(ret == ARGON2_MEMORY_BUFFER_TOO_SMALL);
+        ret = argon2_ctx_with_memory(&context, Argon2_id, NULL, required);
+        assert(ret == ARGON2_MEMORY_BUFFER_TOO_SMALL);
+        printf("Reject a missing or short buffer: PASS\n");
+        free(memory);
+    }
+
+    printf("\n");
+    printf("Session tests\n");
+
+    {
+        argon2_session *session;
+        char encoded[128];
+        uint32_t flags;
+
+        ret = argon2_hash(1, 1 << 8, 2, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+
+        for (flags = 0; flags <= ARGON2_SESSION_DEFER_WIPE; ++flags) {
+            session = argon2_session_create(flags);
+            assert(session != NULL);
+            ret = argon2_session_verify(session, encoded, "password",
+                                        strlen("password"), Argon2_id);
+            assert(ret == ARGON2_OK);
+            ret = argon2_session_verify(session, encoded, "passwore",
+                                        strlen("passwore"), Argon2_id);
+            assert(ret == ARGON2_VERIFY_MISMATCH);
+            ret = argon2_session_verify(session, encoded, "password",
+                                        strlen("password"), Argon2_id);
+            assert(ret == ARGON2_OK);
+            assert(argon2_session_scrub_idle(session, UINT64_MAX) == 0);
+            assert(argon2_session_scrub_idle(session, 0) == 1);
+            assert(argon2_session_scrub_idle(session, 0) == 0);
+            argon2_session_release(session);
+        }
+        printf("Verify repeatedly in a session: PASS\n");
+    }
+
+    {
+        argon2_session *session;
+        argon2_memory_stats before, stats;
+        char encoded[128];
+        size_t required = argon2_memory_required(1 << 8, 1);
+
+        argon2_get_memory_stats(&before);
+        session = argon2_session_create(0);
+        assert(session != NULL);
+        ret = argon2_hash(1, 1 << 8, 1, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+        ret = argon2_session_verify(session, encoded, "password",
+                                    strlen("password"), Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        argon2_get_memory_stats(&stats);
+        assert(stats.arenas == before.arenas + 1);
+        assert(stats.reserved_bytes == before.reserved_bytes + required);
+        assert(stats.resident_bytes == before.resident_bytes + required);
+
+        assert(argon2_arena_trim(0) >= required);
+        argon2_get_memory_stats(&stats);
+        assert(stats.reserved_bytes == before.reserved_bytes + required);
+        assert(stats.resident_bytes == 0);
+
+        /* Trimmed pages come back on the next hash */
+        ret = argon2_session_verify(session, encoded, "password",
+                                    strlen("password"), Argon2_id);
+        assert(ret == ARGON2_OK);
+        argon2_session_release(session);
+        argon2_get_memory_stats(&stats);
+        assert(stats.arenas == before.arenas);
+        printf("Trim idle session memory: PASS\n");
+    }
+
+    {
+        argon2_memory_stats before, stats;
+        char encoded[128];
+        size_t blocks = (size_t)(1 << 8) * 1024;
+
+        argon2_get_memory_stats(&before);
+        ret = argon2_thread_cache_enable(2 * blocks);
+        assert(ret == ARGON2_OK);
+
+        ret = argon2_hash(1, 1 << 8, 1, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+        argon2_get_memory_stats(&stats);
+        assert(stats.arenas == before.arenas + 1);
+        assert(stats.reserved_bytes == before.reserved_bytes + blocks);
+
+        /* Reused when the next request fits */
+        ret = argon2_verify(encoded, "password", strlen("password"),
+                            Argon2_id);
+        assert(ret == ARGON2_OK);
+        argon2_get_memory_stats(&stats);
+        assert(stats.reserved_bytes == before.reserved_bytes + blocks);
+
+        /* Above the cap: plain allocation, the arena stays as it is */
+        ret = argon2_hash(1, 1 << 12, 1, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, version);
+        assert(ret == ARGON2_OK);
+        argon2_get_memory_stats(&stats);
+        assert(stats.reserved_bytes == before.reserved_bytes + blocks);
+
+#ifdef TEST_THREADS
+        {
+            /* An arena still handed out outlives its thread until put */
+            pthread_t thread;
+            argon2_arena *owner = NULL;
+
+            argon2_get_memory_stats(&before);
+            assert(pthread_create(&thread, NULL, cache_take, &owner) == 0);
+            assert(pthread_join(thread, NULL) == 0);
+            argon2_get_memory_stats(&stats);
+            assert(stats.arenas == before.arenas + 1);
+            arena_cache_put(owner);
+            argon2_get_memory_stats(&stats);
+            assert(stats.arenas == before.arenas);
+            assert(stats.reserved_bytes == before.reserved_bytes);
+        }
+#endif
+
+        ret = argon2_thread_cache_enable(0);
+        assert(ret == ARGON2_OK);
+        printf("Cache arenas per thread: PASS\n");
+    }
+
+    printf("\n");
+    printf("Incremental hashing tests\n");
+
+    {
+        argon2_context context;
+        argon2_state *state;
+        unsigned char expected[32], out[32];
+        unsigned steps = 0;
+
+        init_context(&context, expected, sizeof(expected), 2);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        /* One segment per step: 2 passes * 4 slices * 2 lanes */
+        context.out = out;
+        ret = argon2_begin(&context, Argon2_id, &state);
+        assert(ret == ARGON2_OK);
+        while ((ret = argon2_step(state, 1)) > 0) {
+            ++steps;
+        }
+        assert(ret == ARGON2_OK);
+        assert(steps == 2 * 4 * 2 - 1);
+        ret = argon2_finish(state);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+        printf("Hash in single-segment steps: PASS\n");
+
+        /* Finishing early fills the rest */
+        memset(out, 0, sizeof(out));
+        ret = argon2_begin(&context, Argon2_id, &state);
+        assert(ret == ARGON2_OK);
+        assert(argon2_step(state, 3) == 1);
+        ret = argon2_finish(state);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+
+        ret = argon2_begin(&context, Argon2_id, &state);
+        assert(ret == ARGON2_OK);
+        argon2_abort(state);
+
+        ret = argon2_begin(&context, (argon2_type)3, &state);
+        assert(ret == ARGON2_INCORRECT_TYPE && state == NULL);
+        assert(argon2_step(NULL, 1) == ARGON2_INCORRECT_PARAMETER);
+        printf("Finish or abort a hash in progress: PASS\n");
+
+#ifdef TEST_THREADS
+        {
+            pthread_t thread;
+            void *begun;
+
+            /* With the thread cache on, the memory must outlive the thread */
+            ret = argon2_thread_cache_enable(UINT32_C(64) << 20);
+            assert(ret == ARGON2_OK);
+            memset(out, 0, sizeof(out));
+            assert(pthread_create(&thread, NULL, begin_thread, &context) == 0);
+            assert(pthread_join(thread, &begun) == 0);
+            ret = argon2_finish((argon2_state *)begun);
+            assert(ret == ARGON2_OK);
+            assert(memcmp(out, expected, sizeof(out)) == 0);
+            ret = argon2_thread_cache_enable(0);
+            assert(ret == ARGON2_OK);
+            printf("Begin and finish on different threads: PASS\n");
+        }
+#endif
+    }
+
+    printf("\n");
+    printf("Cancellation tests\n");
+
+    {
+        argon2_context context;
+        argon2_state *state;
+        unsigned char expected[32], out[32];
+        volatile int cancel = 0;
+        uint32_t threads;
+
+        init_context(&context, expected, sizeof(expected), 2);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        context.out = out;
+        context.flags = ARGON2_FLAG_CANCEL;
+        context.cancel = &cancel;
+        for (threads = 1; threads <= 2; ++threads) {
+            context.threads = threads;
+
+            cancel = 0;
+            context.deadline_ns = argon2_monotonic_ns() + UINT64_C(3600) *
+                                                              1000000000;
+            ret = argon2_ctx(&context, Argon2_id);
+            assert(ret == ARGON2_OK);
+            assert(memcmp(out, expected, sizeof(out)) == 0);
+
+            cancel = 1;
+            ret = argon2_ctx(&context, Argon2_id);
+            assert(ret == ARGON2_CANCELLED);
+
+            cancel = 0;
+            context.deadline_ns = 1;
+            ret = argon2_ctx(&context, Argon2_id);
+            assert(ret == ARGON2_DEADLINE_EXCEEDED);
+        }
+        printf("Stop at a cancelled token or a missed deadline: PASS\n");
+
+        context.deadline_ns = 0;
+        ret = argon2_begin(&context, Argon2_id, &state);
+        assert(ret == ARGON2_OK);
+        assert(argon2_step(state, 1) == 1);
+        cancel = 1;
+        assert(argon2_step(state, 1) == ARGON2_CANCELLED);
+        argon2_abort(state);
+
+        ret = argon2_begin(&context, Argon2_id, &state);
+        assert(ret == ARGON2_OK);
+        assert(argon2_finish(state) == ARGON2_CANCELLED);
+
+        /* Without the flag the fields are ignored */
+        context.flags = ARGON2_DEFAULT_FLAGS;
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+        printf("Cancel a hash in progress: PASS\n");
+    }
+
+    printf("\n");
+    printf("Executor tests\n");
+
+    {
+        argon2_context context;
+        unsigned char expected[32], out[32];
+
+        init_context(&context, expected, sizeof(expected), 4);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        /* Fewer slots than threads: segments take turns */
+        ret = argon2_executor_configure(1);
+        assert(ret == ARGON2_OK);
+        context.out = out;
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+
+        memset(out, 0, sizeof(out));
+        context.flags = ARGON2_FLAG_BULK;
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+
+        ret = argon2_executor_configure(0);
+        assert(ret == ARGON2_OK);
+        printf("Hash under a segment slot limit: PASS\n");
+
+#ifdef TEST_THREADS
+        {
+            argon2_context bulk;
+            argon2_instance_t interactive;
+            argon2_metrics metrics;
+            unsigned char bulk_out[32];
+            pthread_t thread;
+            uint32_t claim;
+            void *result;
+
+            /* An interactive hash holding the only slot */
+            ret = argon2_executor_configure(1);
+            assert(ret == ARGON2_OK);
+            context.flags = ARGON2_DEFAULT_FLAGS;
+            memset(&interactive, 0, sizeof(interactive));
+            interactive.threads = 1;
+            interactive.context_ptr = &context;
+            claim = executor_claim(&interactive);
+            assert(claim == 1);
+
+            init_context(&bulk, bulk_out, sizeof(bulk_out), 1);
+            bulk.flags = ARGON2_FLAG_BULK;
+            assert(pthread_create(&thread, NULL, ctx_thread, &bulk) == 0);
+            wait_queued(1);
+
+            /* Other interactive hashes still run; the bulk one waits */
+            context.lanes = 1;
+            context.threads = 1;
+            context.out = out;
+            ret = argon2_ctx(&context, Argon2_id);
+            assert(ret == ARGON2_OK);
+            argon2_metrics_snapshot(&metrics);
+            assert(metrics.queued_segments == 1);
+
+            executor_unclaim(claim);
+            assert(pthread_join(thread, &result) == 0);
+            assert((intptr_t)result == ARGON2_OK);
+            assert(memcmp(bulk_out, out, sizeof(out)) == 0);
+            argon2_metrics_snapshot(&metrics);
+            assert(metrics.queued_segments == 0);
+
+            ret = argon2_executor_configure(0);
+            assert(ret == ARGON2_OK);
+            printf("Queue bulk segments behind an interactive claim: PASS\n");
+        }
+#endif
+    }
+
+    {
+        argon2_context context;
+        argon2_metrics metrics;
+        unsigned char expected[32], out[32];
+        uint32_t cap;
+
+        init_context(&context, expected, sizeof(expected), 8);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+
+        /* Same lanes, fewer threads: same tag */
+        cap = argon2_thread_cap_enable(1);
+        context.out = out;
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        assert(memcmp(out, expected, sizeof(out)) == 0);
+        argon2_metrics_snapshot(&metrics);
+        assert(metrics.thread_cap == cap);
+        assert(metrics.last_threads == (cap != 0 && cap < 8 ? cap : 8));
+
+        assert(argon2_thread_cap_enable(0) == 0);
+        ret = argon2_ctx(&context, Argon2_id);
+        assert(ret == ARGON2_OK);
+        argon2_metrics_snapshot(&metrics);
+        assert(metrics.thread_cap == 0);
+        assert(metrics.last_threads == 8);
+        printf("Hash with threads capped at the usable CPUs: PASS\n");
+    }
+
+    printf("\n");
+    printf("Locality statistics tests\n");
+    {
+        argon2_locality_stats stats;
+        uint8_t out[32];
+        int traced;
+
+        argon2_reset_locality_stats();
+        ret = argon2_hash(2, 64, 2, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), out, sizeof(out),
+                          NULL, 0, Argon2_d, ARGON2_VERSION_NUMBER);
+        assert(ret == ARGON2_OK);
+        traced = argon2_get_locality_stats(Argon2_d, 0, 1, &stats);
+#ifdef ARGON2_TRACE_LOCALITY
+        {
+            /* 64 blocks in 2 lanes: 8-block segments */
+            uint64_t counted = 0;
+            unsigned k;
+            assert(traced == 1);
+            assert(stats.segments == 2 && stats.refs == 16);
+            for (k = 0; k < ARGON2_LOCALITY_BUCKETS; ++k) {
+                counted += stats.distance[k];
+            }
+            assert(counted == stats.refs);
+            assert(stats.pages_4k > 0 && stats.pages_2m == 2);
+
+            /* The first slice only references its own lane */
+            traced = argon2_get_locality_stats(Argon2_d, 0, 0, &stats);
+            assert(traced == 1 && stats.refs == 12 && stats.cross_lane == 0);
+        }
+#else
+        assert(traced == 0 && stats.refs == 0);
+#endif
+        argon2_reset_locality_stats();
+        traced = argon2_get_locality_stats(Argon2_d, 0, 1, &stats);
+        assert(stats.segments == 0 && stats.refs == 0);
+        printf("Reference locality accounting: PASS\n");
+    }
+
+    printf("\n");
+    printf("Metrics tests\n");
+    {
+        argon2_metrics before, after;
+        const argon2_metrics_histogram *h = NULL;
+        char encoded[128], small[16], *text;
+        size_t len;
+        uint32_t i;
+
+        argon2_metrics_snapshot(&before);
+        ret = argon2_hash(2, 64, 2, "password", strlen("password"),
+                          "somesalt", strlen("somesalt"), NULL, 32, encoded,
+                          sizeof(encoded), Argon2_id, ARGON2_VERSION_NUMBER);
+        assert(ret == ARGON2_OK);
+        ret = argon2_verify(encoded, "passwore", strlen("passwore"),
+                            Argon2_id);
+        assert(ret == ARGON2_VERIFY_MISMATCH);
+        argon2_metrics_snapshot(&after);
+
+        assert(after.hashes[Argon2_id] == before.hashes[Argon2_id] + 2);
+        assert(after.verifies[Argon2_id] == before.verifies[Argon2_id] + 1);
+        assert(after.failures[-ARGON2_VERIFY_MISMATCH] ==
+               before.failures[-ARGON2_VERIFY_MISMATCH] + 1);
+        assert(after.allocated_bytes == before.allocated_bytes);
+        assert(after.active_workers == 0 && after.queued_segments == 0);
+        for (i = 0; i < after.histograms; ++i) {
+            if (after.histogram[i].type == Argon2_id &&
+                after.histogram[i].m_cost == 64 &&
+                after.histogram[i].t_cost == 2 &&
+                after.histogram[i].lanes == 2) {
+                h = &after.histogram[i];
+            }
+        }
+        /* Earlier tests may have used up the parameter sets */
+        if (h == NULL) {
+            assert(after.histograms == ARGON2_METRICS_TUPLES);
+            assert(after.other.count >= before.other.count + 2);
+        } else {
+            assert(h->count >= 2 && h->sum_ns > 0);
+        }
+        printf("Count hashes, verifies and failures: PASS\n");
+
+        assert(argon2_metrics_bucket_ns(0) == 81920);
+        assert(argon2_metrics_bucket_ns(3) == UINT64_C(1) << 17);
+        assert(argon2_metrics_bucket_ns(ARGON2_METRICS_BUCKETS - 1) ==
+               UINT64_C(1) << 36);
+        len = argon2_metrics_openmetrics(&after, NULL, 0);
+        text = malloc(len + 1);
+        assert(text != NULL);
+        assert(argon2_metrics_openmetrics(&after, text, len + 1) == len);
+        assert(strlen(text) == len);
+        assert(strstr(text, "argon2_hashes_total{type=\"argon2id\"} ") != NULL);
+        assert(strstr(text, "argon2_failures_total{code=\"-35\"} ") != NULL);
+        assert(strstr(text, "argon2_hash_duration_seconds_bucket{type=\"") !=
+               NULL);
+        assert(strcmp(text + len - 6, "# EOF\n") == 0);
+        free(text);
+        assert(argon2_metrics_openmetrics(&after, small, sizeof(small)) ==
+               len);
+        assert(strlen(small) == sizeof(small) - 1);
+        printf("OpenMetrics export: PASS\n");
+    }
+
+#ifdef TEST_SERVE
+    printf("\n");
+    printf("Serve tests\n");
+    servetest();
+#endif
+
     return 0;
 }
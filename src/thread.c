@@ -15,11 +15,19 @@
  * software. If not, they may be obtained at the above URLs.
  */
 
+/* for sched_getaffinity() and CPU_COUNT on glibc */
+#define _GNU_SOURCE 1
+
 #if !defined(ARGON2_NO_THREADS)
 
 #include "thread.h"
 #if defined(_WIN32)
 #include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #endif
 
 int argon2_thread_create(argon2_thread_handle_t *handle,
@@ -54,4 +62,132 @@ void argon2_thread_exit(void) {
 #endif
 }
 
+#if defined(__linux__)
+/*
+ * CPUs granted by the cgroup v2 cpu.max quotas of the process's cgroup and
+ * its ancestors, rounded up; 0 if there is no quota or no cgroup v2
+ */
+static uint32_t cgroup_cpus(void) {
+    char line[512], path[600], quota[32];
+    char *dir = NULL, *slash;
+    unsigned long period, cpus, min_cpus = 0;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::/", 4) == 0) {
+            dir = line + 3;
+            dir[strcspn(dir, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(f);
+
+    while (dir != NULL) {
+        sprintf(path, "/sys/fs/cgroup%s/cpu.max", dir[1] == '\0' ? "" : dir);
+        f = fopen(path, "r");
+        if (f != NULL) {
+            if (fscanf(f, "%31s %lu", quota, &period) == 2 &&
+                strcmp(quota, "max") != 0 && period != 0) {
+                cpus = (strtoul(quota, NULL, 10) + period - 1) / period;
+                if (cpus != 0 && (min_cpus == 0 || cpus < min_cpus)) {
+                    min_cpus = cpus;
+                }
+            }
+            fclose(f);
+        }
+
+        /* Up to the parent, ending with the root */
+        slash = strrchr(dir, '/');
+        if (dir[1] == '\0') {
+            dir = NULL;
+        } else if (slash == dir) {
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+    return min_cpus > UINT32_MAX ? UINT32_MAX : (uint32_t)min_cpus;
+}
+#endif
+
+uint32_t argon2_cpu_count(void) {
+#if defined(_WIN32)
+    DWORD_PTR process_mask, system_mask;
+    uint32_t cpus = 0;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+                                &system_mask)) {
+        return 0;
+    }
+    for (; process_mask != 0; process_mask &= process_mask - 1) {
+        ++cpus;
+    }
+    return cpus;
+#elif defined(__linux__) && defined(CPU_COUNT)
+    cpu_set_t set;
+    uint32_t cpus = 0, quota = cgroup_cpus();
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = (uint32_t)CPU_COUNT(&set);
+    }
+    if (quota != 0 && (cpus == 0 || quota < cpus)) {
+        cpus = quota;
+    }
+    return cpus;
+#else
+    return 0;
+#endif
+}
+
+void argon2_mutex_init(argon2_mutex_t *mutex) {
+#if defined(_WIN32)
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void argon2_mutex_destroy(argon2_mutex_t *mutex) {
+#if defined(_WIN32)
+    (void)mutex; /* SRW locks hold no resources */
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void argon2_mutex_lock(argon2_mutex_t *mutex) {
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void argon2_mutex_unlock(argon2_mutex_t *mutex) {
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void argon2_cond_wait(argon2_cond_t *cond, argon2_mutex_t *mutex) {
+#if defined(_WIN32)
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void argon2_cond_broadcast(argon2_cond_t *cond) {
+#if defined(_WIN32)
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
 #endif /* ARGON2_NO_THREADS */
@@ -20,6 +20,8 @@
 
 #if !defined(ARGON2_NO_THREADS)
 
+#include <stdint.h>
+
 /*
         Here we implement an abstraction layer for the simpĺe requirements
         of the Argon2 code. We only require 3 primitives---thread creation,
@@ -63,5 +65,63 @@ int argon2_thread_join(argon2_thread_handle_t handle);
 */
 void argon2_thread_exit(void);
 
+/* Counts the CPUs the process may run on: its affinity mask and, on Linux,
+ * the cgroup v2 cpu.max quotas, rounded up to whole CPUs.
+ * @return The number of CPUs, 0 if it cannot be determined.
+*/
+uint32_t argon2_cpu_count(void);
+
+#endif /* ARGON2_NO_THREADS */
+
+/*
+        A statically initializable mutex, ARGON2_MUTEX_INIT (or
+        argon2_mutex_init at run time), with lock and unlock, and a condition
+        variable, ARGON2_COND_INIT, to wait on under it. They compile to
+        nothing when threads are disabled.
+*/
+#if defined(ARGON2_NO_THREADS)
+typedef int argon2_mutex_t;
+#define ARGON2_MUTEX_INIT 0
+#define argon2_mutex_init(mutex) (*(mutex) = 0)
+#define argon2_mutex_destroy(mutex) ((void)(mutex))
+#define argon2_mutex_lock(mutex) ((void)(mutex))
+#define argon2_mutex_unlock(mutex) ((void)(mutex))
+typedef int argon2_cond_t;
+#define ARGON2_COND_INIT 0
+#define argon2_cond_wait(cond, mutex) ((void)(cond), (void)(mutex))
+#define argon2_cond_broadcast(cond) ((void)(cond))
+#else
+#if defined(_WIN32)
+#include <windows.h>
+typedef SRWLOCK argon2_mutex_t;
+#define ARGON2_MUTEX_INIT SRWLOCK_INIT
+typedef CONDITION_VARIABLE argon2_cond_t;
+#define ARGON2_COND_INIT CONDITION_VARIABLE_INIT
+#else
+typedef pthread_mutex_t argon2_mutex_t;
+#define ARGON2_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+typedef pthread_cond_t argon2_cond_t;
+#define ARGON2_COND_INIT PTHREAD_COND_INITIALIZER
+#endif
+
+/* Initializes a mutex that cannot use ARGON2_MUTEX_INIT, e.g. in the heap */
+void argon2_mutex_init(argon2_mutex_t *mutex);
+
+/* Releases the resources of an unlocked mutex from argon2_mutex_init() */
+void argon2_mutex_destroy(argon2_mutex_t *mutex);
+
+/* Acquires @mutex, blocking until it is available */
+void argon2_mutex_lock(argon2_mutex_t *mutex);
+
+/* Releases @mutex, which the calling thread must hold */
+void argon2_mutex_unlock(argon2_mutex_t *mutex);
+
+/* Releases @mutex, which the calling thread must hold, waits until @cond is
+ * signalled (or spuriously) and reacquires @mutex */
+void argon2_cond_wait(argon2_cond_t *cond, argon2_mutex_t *mutex);
+
+/* Wakes every thread waiting on @cond */
+void argon2_cond_broadcast(argon2_cond_t *cond);
 #endif /* ARGON2_NO_THREADS */
+
 #endif